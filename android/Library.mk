@@ -4,9 +4,9 @@ include $(CLEAR_VARS)
 
 LOCAL_MODULE    := shine
 LOCAL_SRC_FILES := src/lib/bitstream.c src/lib/formatbits.c src/lib/huffman.c \
-                   src/lib/l3bitstream.c src/lib/l3loop.c src/lib/l3mdct.c \
-                   src/lib/l3subband.c src/lib/layer3.c src/lib/reservoir.c \
-                   src/lib/tables.c
+                   src/lib/kernels_x86.c src/lib/l3bitstream.c src/lib/l3loop.c \
+                   src/lib/l3mdct.c src/lib/l3subband.c src/lib/layer3.c \
+                   src/lib/reservoir.c src/lib/tables.c
 LOCAL_LDLIBS    := -lm
 
 include $(BUILD_SHARED_LIBRARY)
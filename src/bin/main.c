@@ -34,6 +34,7 @@
 char *infname, *outfname;
 FILE *infile, *outfile;
 int quiet = 0;
+int joint = 0;
 int _verbose = 0;
 
 int verbose()
@@ -66,6 +67,10 @@ static void print_usage()
 	printf(" -h            this help message\n");
 	printf(" -b <bitrate>  set the bitrate [32-320], default 128kbit\n");
 	printf(" -c            set copyright flag, default off\n");
+	printf(" -j            joint stereo (mid/side, intensity at 64kbit and below), default off\n");
+	printf(" -V <quality>  variable bitrate, quality [1-9] (1 is best), default off\n");
+	printf(" -A <frames>   average bitrate over windows of [1-1024] frames, default off\n");
+	printf(" -s <level>    speed [0-3] (0 is best quality, 3 fastest), default 0\n");
 	printf(" -q            quiet mode\n");
 	printf(" -v            verbose mode\n");
 }
@@ -93,6 +98,22 @@ static int parse_command(int argc, char** argv, shine_config_t *config)
 				config->mpeg.copyright = 1;
 				break;
 
+			case 'j':
+				joint = 1;
+				break;
+
+			case 'V':
+				config->mpeg.vbr = atoi(argv[++i]);
+				break;
+
+			case 'A':
+				config->mpeg.abr = atoi(argv[++i]);
+				break;
+
+			case 's':
+				config->mpeg.speed = atoi(argv[++i]);
+				break;
+
 			case 'q':
 				quiet = 1;
 				_verbose = 0;
@@ -122,7 +143,12 @@ static void check_config(shine_config_t *config)
 
 	printf("MPEG-I layer III, %s  Psychoacoustic Model: Shine\n",
 		mode_names[config->mpeg.mode]);
-	printf("Bitrate: %d kbps  ", config->mpeg.bitr);
+	if (config->mpeg.vbr)
+		printf("VBR quality: %d  ", config->mpeg.vbr);
+	else if (config->mpeg.abr)
+		printf("Average bitrate: %d kbps over %d frames  ", config->mpeg.bitr, config->mpeg.abr);
+	else
+		printf("Bitrate: %d kbps  ", config->mpeg.bitr);
 	printf("De-emphasis: %s   %s %s\n",
 		demp_names[config->mpeg.emph],
 		((config->mpeg.original) ? "Original" : ""),
@@ -165,6 +191,9 @@ int main(int argc, char **argv)
 
 	/* See if bitrate is valid */
 	if (shine_find_bitrate_index(config.mpeg.bitr) < 0) error("Unsupported bitrate");
+	if (config.mpeg.vbr < 0 || config.mpeg.vbr > 9) error("Unsupported VBR quality");
+	if (config.mpeg.abr < 0 || config.mpeg.abr > 1024) error("Unsupported ABR window");
+	if (config.mpeg.speed < 0 || config.mpeg.speed > 3) error("Unsupported speed level");
 
 	/* open the output file */
 	if (!strcmp(outfname, "-"))
@@ -178,7 +207,7 @@ int main(int argc, char **argv)
 
 	/* Set to stereo mode if wave data is stereo, mono otherwise. */
 	if (config.wave.channels > 1)
-		config.mpeg.mode = STEREO;
+		config.mpeg.mode = joint ? JOINT_STEREO : STEREO;
 	else
 		config.mpeg.mode = MONO;
 
@@ -188,6 +217,12 @@ int main(int argc, char **argv)
 	/* Initiate encoder */
 	s = shine_initialise(&config);
 
+	/* The Xing frame goes first, it is rewritten once the stream is known */
+	if (config.mpeg.vbr || config.mpeg.abr) {
+		data = shine_xing_frame(s, &written);
+		write_mp3(written, data, &config);
+	}
+
 	/* All the magic happens here */
 	while (wave_get(buffer, &wave, &config)) {
 		data = shine_encode_frame(s, buffer, &written);
@@ -198,6 +233,11 @@ int main(int argc, char **argv)
 	data = shine_flush(s, &written);
 	write_mp3(written, data, &config);
 
+	if ((config.mpeg.vbr || config.mpeg.abr) && outfile != stdout && !fseek(outfile, 0, SEEK_SET)) {
+		data = shine_xing_frame(s, &written);
+		write_mp3(written, data, &config);
+	}
+
 	/* Close encoder. */
 	shine_close(s);
 
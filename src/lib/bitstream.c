@@ -15,53 +15,51 @@
 #endif
 
 /*
- * shine_empty_buffer
+ * write_cache
  * ------------
- * empty the buffer to the output device when the buffer becomes full
+ * append the 8 bytes of the full bit cache to the data, which is sized
+ * for the largest output of a frame (see shine_initialise) and emptied
+ * after each one
  */
-void shine_empty_buffer(bitstream_t *bs, int minimum)
+static void write_cache(bitstream_t *bs)
 {
-  int total = bs->buf_size-minimum;
   int i;
 
-  if (bs->data_size-bs->data_position < total) {
-    bs->data = realloc(bs->data, sizeof(unsigned char)*(total+bs->data_position));
-    bs->data_size = total+bs->data_position; 
-  }
- 
-  for (i=minimum;i<bs->buf_size;i++)
-    bs->data[bs->data_position+bs->buf_size-1-i] = bs->buf[i];
-
-  bs->data_position += total; 
-
-  for (i=0;i<minimum; i++)
-    bs->buf[bs->buf_size - minimum + i] = bs->buf[i];
+  for (i=0; i<8; i++)
+    bs->data[bs->data_position+i] = (unsigned char)(bs->cache >> (56-(i<<3)));
+  bs->data_position += 8;
+}
 
-  bs->buf_byte_idx = bs->buf_size -1 - minimum;
-  bs->buf_bit_idx = 8;
+/*
+ * shine_flush_bits
+ * ------------
+ * write the whole bytes held in the bit cache to the data, a partial
+ * byte stays in the cache
+ */
+void shine_flush_bits(bitstream_t *bs)
+{
+  while (bs->cache_bits <= 56) {
+    bs->data[bs->data_position++] = (unsigned char)(bs->cache >> 56);
+    bs->cache <<= 8;
+    bs->cache_bits += 8;
+  }
 }
 
 /* open the device to write the bit stream into it */
 void shine_open_bit_stream(bitstream_t *bs, int size)
 {
-  bs->data = NULL;
-  bs->data_size = 0;
+  bs->data = (unsigned char *)malloc(size*sizeof(unsigned char));
+  bs->data_size = size;
   bs->data_position = 0;
-  bs->buf = (unsigned char *)malloc(size*sizeof(unsigned char));
-  bs->buf_size = size;
-  bs->buf_byte_idx = size-1;
-  bs->buf_bit_idx=8;
+  bs->cache = 0;
+  bs->cache_bits = 64;
   bs->totbit=0;
-  bs->mode = WRITE_MODE;
-  bs->eob = false;
-  bs->eobs = false;
 }
 
 /*close the device containing the bit stream */
 void shine_close_bit_stream(bitstream_t *bs)
 {
   if (bs->data) free(bs->data);
-  free(bs->buf);
 }
 
 /*
@@ -70,35 +68,30 @@ void shine_close_bit_stream(bitstream_t *bs)
  * write N bits into the bit stream.
  * bs = bit stream structure
  * val = value to write into the buffer
- * N = number of bits of val
+ * N = number of bits of val, less than 64
+ * The bits are gathered msb first in a 64 bit cache, which is written to
+ * the data 8 bytes at a time when it is full.
  */
-void shine_putbits(bitstream_t *bs, unsigned long int val, unsigned int N)
+void shine_putbits(bitstream_t *bs, uint64_t val, unsigned int N)
 {
-  static int putmask[9]={0x0, 0x1, 0x3, 0x7, 0xf, 0x1f, 0x3f, 0x7f, 0xff};
-  register int j = N;
-  register int k, tmp;
-
   #ifdef DEBUG
   if (N > MAX_LENGTH)
     printf("Cannot read or write more than %d bits at a time.\n", MAX_LENGTH);
   #endif
 
+  val &= ((uint64_t)1 << N) - 1;
   bs->totbit += N;
-  while (j > 0)
-  {
-    k = MIN(j, bs->buf_bit_idx);
-    tmp = val >> (j-k);
-    bs->buf[bs->buf_byte_idx] |= (tmp&putmask[k]) << (bs->buf_bit_idx-k);
-    bs->buf_bit_idx -= k;
-    if (!bs->buf_bit_idx)
-    {
-      bs->buf_bit_idx = 8;
-      bs->buf_byte_idx--;
-      if (bs->buf_byte_idx < 0)
-        shine_empty_buffer(bs, MINIMUM);
-      bs->buf[bs->buf_byte_idx] = 0;
-    }
-    j -= k;
+
+  if (N < bs->cache_bits) {
+    bs->cache_bits -= N;
+    bs->cache |= (uint64_t)val << bs->cache_bits;
+  }
+  else {
+    N -= bs->cache_bits;
+    bs->cache |= (uint64_t)val >> N;
+    write_cache(bs);
+    bs->cache_bits = 64 - N;
+    bs->cache = N ? (uint64_t)val << bs->cache_bits : 0;
   }
 }
 
@@ -107,4 +100,3 @@ unsigned long shine_sstell(bitstream_t *bs)
 {
   return(bs->totbit);
 }
-
@@ -32,177 +32,83 @@
 
 void shine_formatbits_initialise(shine_global_config *config)
 {
-  config->formatbits.BitCount        = 0;
-  config->formatbits.ThisFrameSize   = 0;
-  config->formatbits.BitsRemaining   = 0;
-  config->formatbits.side_queue_head = NULL;
-  config->formatbits.side_queue_free = NULL;
-}
-
-void shine_side_info_free(side_info_link *cur, shine_global_config *config)
-{
-  int ch, gr;
-
-  side_info_link *next;
-  BF_FrameData *info = &config->l3stream.frameData;
-
-  while (cur) {
-    shine_BF_freePartHolder(cur->side_info.headerPH);
-    shine_BF_freePartHolder(cur->side_info.frameSIPH);
-      for ( ch = 0; ch < info->nChannels; ch++ )
-        shine_BF_freePartHolder(cur->side_info.channelSIPH[ch]);
-      for ( gr = 0; gr < info->nGranules; gr++ )
-        for ( ch = 0; ch < info->nChannels; ch++ )
-          shine_BF_freePartHolder(cur->side_info.spectrumSIPH[gr][ch]);
-
-    next = cur->next;
-    free(cur);
-    cur  = next;
-  }
-}
-
-void shine_formatbits_close(shine_global_config *config)
-{
-  shine_side_info_free(config->formatbits.side_queue_head, config);
-  shine_side_info_free(config->formatbits.side_queue_free, config);
+  config->formatbits.BitCount         = 0;
+  config->formatbits.ThisFrameSize    = 0;
+  config->formatbits.BitsRemaining    = 0;
+  config->formatbits.side_queue_head  = 0;
+  config->formatbits.side_queue_count = 0;
 }
 
 /* forward declarations */
-static int store_side_info( BF_FrameData *frameInfo, shine_global_config *config );
-static int main_data( BF_FrameData *frameInfo, BF_FrameResults *results, shine_global_config *config);
-static void WriteMainDataBits( unsigned long int val, unsigned int nbits, BF_FrameResults *results, shine_global_config *config);
+static int shine_write_side_info(shine_global_config *config);
 
 /*
- * BF_BitStreamFrame:
- * ------------------
+ * shine_BF_newSideInfo:
+ * ---------------------
  * This is the public interface to the bitstream
- * formatting package. It writes one frame of main data per call.
+ * formatting package, called once per frame before its main data.
+ * Returns the (empty) header and side information of a frame of
+ * #frameLength# bits, placed at the end of the queue. They are filled
+ * with shine_BF_addSideInfo and written by shine_BF_writeMainData when
+ * the main data reaches the frame.
  *
  * Assumptions:
  * - The back pointer is zero on the first call
  * - An integral number of bytes is written each frame
- *
- * You should be able to change the frame length, side info
- * length, #channels, #granules on a frame-by-frame basis.
- *
- * See formatBitstream.h for more information about the data
- * structures and the bitstream syntax.
+ * - No more than SIDE_QUEUE frames wait for their main data
  */
-void shine_BF_BitstreamFrame(shine_global_config *config)
+MYSideInfo *shine_BF_newSideInfo(int frameLength, shine_global_config *config)
 {
-  BF_FrameData *frameInfo  = &config->l3stream.frameData;
-  BF_FrameResults *results = &config->l3stream.frameResults;
-  /* get ptr to bit writing function */
-  /* save SI and compute its length */
-  results->SILength = store_side_info( frameInfo, config );
-
-  /* write the main data, inserting SI to maintain framing */
-  results->mainDataLength = main_data( frameInfo, results, config );
-
-  /*
-   * Caller must ensure that back SI and main data are
-   * an integral number of bytes, since the back pointer
-   * can only point to a byte boundary and this code
-   * does not add stuffing bits
-   */
-  /* assert( (BitsRemaining % 8) == 0 );*/
-}
-
-/*
- * shine_BF_PartLength:
- * --------------
- */
-int shine_BF_PartLength( BF_BitstreamPart *part )
-{
-  BF_BitstreamElement *ep = part->element;
-  int i, bits;
+  formatbits_t *fb = &config->formatbits;
+  MYSideInfo *si;
 
-  bits = 0;
-  for (i = 0; i < part->nrEntries; i++, ep++)
-    bits += ep->length;
-  return bits;
+  /* place at end of queue */
+  si = &fb->side_queue[(fb->side_queue_head + fb->side_queue_count++) % SIDE_QUEUE];
+  memset(si, 0, sizeof(MYSideInfo));
+  si->frameLength = frameLength;
+  return si;
 }
 
-MYSideInfo *shine_get_side_info(shine_global_config *config);
-int shine_write_side_info(shine_global_config *config);
-
 /*
- * shine_writePartMainData:
- * ------------------
+ * shine_BF_addSideInfo:
+ * ---------------------
+ * Appends #nbits# (less than 64) bits of #val# to the header and side
+ * information.
  */
-int shine_writePartMainData(BF_BitstreamPart *part, BF_FrameResults *results, shine_global_config *config)
-{
-  BF_BitstreamElement *ep;
-  int i, bits;
-
-  /* assert(results); */
-  /* assert(part); */
-
-  bits = 0;
-  ep = part->element;
-  for ( i = 0; i < part->nrEntries; i++, ep++ )
-    {
-      WriteMainDataBits( ep->value, ep->length, results, config );
-      bits += ep->length;
-    }
-  return bits;
-}
-
-int shine_writePartSideInfo(BF_BitstreamPart *part, BF_FrameResults *results, shine_global_config *config)
+void shine_BF_addSideInfo(MYSideInfo *si, uint64_t val, unsigned int nbits)
 {
-  BF_BitstreamElement *ep;
-  int i, bits;
-
-  /* assert( part ); */
+  uint64_t *w = &si->si[si->SILength >> 6];
+  int left = 64 - (si->SILength & 63);
 
-  bits = 0;
-  ep = part->element;
-  for ( i = 0; i < part->nrEntries; i++, ep++ )
+  val &= ((uint64_t)1 << nbits) - 1;
+  if ((int)nbits <= left)
+    w[0] |= (uint64_t)val << (left - nbits);
+  else
     {
-      shine_putbits( &config->bs, ep->value, ep->length);
-      bits += ep->length;
+      w[0] |= (uint64_t)val >> (nbits - left);
+      w[1] |= (uint64_t)val << (64 - (nbits - left));
     }
-  return bits;
-}
-
-int main_data(BF_FrameData *fi, BF_FrameResults *results, shine_global_config *config)
-{
-  int gr, ch, bits;
-  bits = 0;
-  results->mainDataLength = 0;
-
-  for (gr = 0; gr < fi->nGranules; gr++)
-    for (ch = 0; ch < fi->nChannels; ch++)
-      {
-        bits += shine_writePartMainData( fi->scaleFactors[gr][ch], results, config );
-        bits += shine_writePartMainData( fi->codedData[gr][ch],    results, config );
-        bits += shine_writePartMainData( fi->userSpectrum[gr][ch], results, config );
-      }
-  bits += shine_writePartMainData( fi->userFrameData, results, config );
-  return bits;
+  si->SILength += nbits;
 }
 
 /*
-  This is a wrapper around PutBits() that makes sure that the
-  framing header and side info are inserted at the proper
-  locations
-*/
-
-void WriteMainDataBits(unsigned long int val,
-                       unsigned int nbits,
-                       BF_FrameResults *results,
-                       shine_global_config *config)
+ * shine_BF_writeMainData:
+ * -----------------------
+ * This is a wrapper around shine_putbits() that makes sure that the
+ * framing header and side info are inserted at the proper locations.
+ */
+void shine_BF_writeMainData(uint64_t val, unsigned int nbits, shine_global_config *config)
 {
-  /* assert( nbits <= 32 ); */
+  /* assert( nbits < 64 ); */
+  if (nbits == 0) return;
   if (config->formatbits.BitCount == config->formatbits.ThisFrameSize)
     {
       config->formatbits.BitCount = shine_write_side_info(config);
       config->formatbits.BitsRemaining = config->formatbits.ThisFrameSize - config->formatbits.BitCount;
     }
-  if (nbits == 0) return;
   if (nbits > config->formatbits.BitsRemaining)
     {
-      unsigned extra = val >> (nbits - config->formatbits.BitsRemaining);
+      uint64_t extra = val >> (nbits - config->formatbits.BitsRemaining);
       nbits -= config->formatbits.BitsRemaining;
       shine_putbits( &config->bs, extra, config->formatbits.BitsRemaining);
       config->formatbits.BitCount = shine_write_side_info(config);
@@ -215,208 +121,70 @@ void WriteMainDataBits(unsigned long int val,
   config->formatbits.BitsRemaining -= nbits;
 }
 
-int shine_write_side_info(shine_global_config *config)
+/*
+ * shine_BF_flush:
+ * ---------------
+ * Pads the main data with zeros to the end of the last frame, writing the
+ * frames still queued on the way, when the last main data ended short of
+ * them because bits were left in the reservoir.
+ */
+void shine_BF_flush(shine_global_config *config)
 {
-  MYSideInfo *si;
-  int bits, ch, gr;
-
-  bits = 0;
-  si = shine_get_side_info(config);
-  config->formatbits.ThisFrameSize = si->frameLength;
-  bits += shine_writePartSideInfo( si->headerPH->part,  NULL, config );
-  bits += shine_writePartSideInfo( si->frameSIPH->part, NULL, config );
+  formatbits_t *fb = &config->formatbits;
 
-  for ( ch = 0; ch < si->nChannels; ch++ )
-    bits += shine_writePartSideInfo( si->channelSIPH[ch]->part, NULL, config );
-
-  for ( gr = 0; gr < si->nGranules; gr++ )
-    for ( ch = 0; ch < si->nChannels; ch++ )
-      bits += shine_writePartSideInfo( si->spectrumSIPH[gr][ch]->part, NULL, config );
-  return bits;
+  while (fb->BitsRemaining > 0 || fb->side_queue_count)
+    shine_BF_writeMainData(0, fb->BitsRemaining > 0 && fb->BitsRemaining < 32 ? fb->BitsRemaining : 32, config);
 }
 
-int store_side_info(BF_FrameData *info, shine_global_config *config)
+/*
+ * shine_BF_backPointer:
+ * ---------------------
+ * The main_data_begin of the next frame: the bytes left before the next
+ * header once this frame's main data has been written, including the
+ * main data of the frames still queued when it ended before reaching them.
+ */
+int shine_BF_backPointer(shine_global_config *config)
 {
-  int ch, gr;
-  side_info_link *l = NULL;
-  /* obtain a side_info_link to store info */
-  side_info_link *f = config->formatbits.side_queue_free;
-  int bits = 0;
-
-  if (f == NULL)
-    { /* must allocate another */
-      l = (side_info_link *) calloc( 1, sizeof(side_info_link) );
-#ifdef DEBUG
-      static int n_si = 0;
-      n_si += 1;
-      printf("allocating side_info_link number %d, %p\n", n_si, l );
-#endif
-      l->next = NULL;
-      l->side_info.headerPH  = shine_BF_newPartHolder( info->header->nrEntries );
-      l->side_info.frameSIPH = shine_BF_newPartHolder( info->frameSI->nrEntries );
-      for ( ch = 0; ch < info->nChannels; ch++ )
-        l->side_info.channelSIPH[ch] = shine_BF_newPartHolder( info->channelSI[ch]->nrEntries );
-      for ( gr = 0; gr < info->nGranules; gr++ )
-        for ( ch = 0; ch < info->nChannels; ch++ )
-          l->side_info.spectrumSIPH[gr][ch] = shine_BF_newPartHolder( info->spectrumSI[gr][ch]->nrEntries );
-    }
-  else
-    { /* remove from the free list */
-      config->formatbits.side_queue_free = f->next;
-      f->next = NULL;
-      l = f;
-    }
-  /* copy data */
-  l->side_info.frameLength = info->frameLength;
-  l->side_info.nGranules   = info->nGranules;
-  l->side_info.nChannels   = info->nChannels;
-  l->side_info.headerPH    = shine_BF_LoadHolderFromBitstreamPart( l->side_info.headerPH,  info->header );
-  l->side_info.frameSIPH   = shine_BF_LoadHolderFromBitstreamPart( l->side_info.frameSIPH, info->frameSI );
-
-  bits += shine_BF_PartLength( info->header );
-  bits += shine_BF_PartLength( info->frameSI );
+  formatbits_t *fb = &config->formatbits;
+  MYSideInfo *si;
+  int i, bits = fb->BitsRemaining;
 
-  for ( ch = 0; ch < info->nChannels; ch++ )
+  for (i = 0; i < fb->side_queue_count; i++)
     {
-      l->side_info.channelSIPH[ch] = shine_BF_LoadHolderFromBitstreamPart(l->side_info.channelSIPH[ch], info->channelSI[ch]);
-      bits += shine_BF_PartLength(info->channelSI[ch]);
-    }
-
-  for ( gr = 0; gr < info->nGranules; gr++ )
-    for ( ch = 0; ch < info->nChannels; ch++ )
-      {
-        l->side_info.spectrumSIPH[gr][ch] = shine_BF_LoadHolderFromBitstreamPart(l->side_info.spectrumSIPH[gr][ch], info->spectrumSI[gr][ch]);
-        bits += shine_BF_PartLength( info->spectrumSI[gr][ch] );
-      }
-  l->side_info.SILength = bits;
-  /* place at end of queue */
-  f = config->formatbits.side_queue_head;
-  if ( f == NULL )
-    {  /* empty queue */
-      config->formatbits.side_queue_head = l;
-    }
-  else
-    { /* find last element */
-      while ( f->next )
-        f = f->next;
-      f->next = l;
+      si = &fb->side_queue[(fb->side_queue_head + i) % SIDE_QUEUE];
+      bits += si->frameLength - si->SILength;
     }
-  return bits;
+  return bits >> 3;
 }
 
-MYSideInfo* shine_get_side_info(shine_global_config *config)
+/*
+ * shine_write_side_info:
+ * ----------------------
+ * Writes the header and side information at the head of the queue and
+ * removes it, returns its length.
+ */
+int shine_write_side_info(shine_global_config *config)
 {
-  side_info_link *f = config->formatbits.side_queue_free;
-  side_info_link *l = config->formatbits.side_queue_head;
+  formatbits_t *fb = &config->formatbits;
+  MYSideInfo *si;
+  uint32_t word;
+  int i, n;
 
   /* If we stop here it means you didn't provide enough headers to support the
     amount of main data that was written. */
-  /* assert(l); */
+  /* assert(fb->side_queue_count); */
 
   /* update queue head */
-  config->formatbits.side_queue_head = l->next;
-
-  /* Append l to the free list. You can continue to use it until store_side_info
-    is called again, which will not happen again for this frame. */
-  config->formatbits.side_queue_free = l;
-  l->next = f;
-  return &l->side_info;
-}
+  si = &fb->side_queue[fb->side_queue_head];
+  fb->side_queue_head = (fb->side_queue_head + 1) % SIDE_QUEUE;
+  fb->side_queue_count--;
 
-/* Allocate a new holder of a given size */
-BF_PartHolder *shine_BF_newPartHolder(unsigned long int max_elements)
-{
-  BF_PartHolder *newPH = calloc(1, sizeof(BF_PartHolder));
-  /* assert( newPH ); */
-  newPH->max_elements = max_elements;
-  newPH->part = calloc(1, sizeof(BF_BitstreamPart));
-  /* assert( newPH->part ); */
-  newPH->part->element = calloc((int)max_elements, sizeof(BF_BitstreamElement));
-  /* assert( newPH->part->element ); */
-  newPH->part->nrEntries = 0;
-  return newPH;
-}
-
-BF_PartHolder *shine_BF_NewHolderFromBitstreamPart( BF_BitstreamPart *thePart )
-{
-  BF_PartHolder *newHolder = shine_BF_newPartHolder( thePart->nrEntries );
-  return shine_BF_LoadHolderFromBitstreamPart( newHolder, thePart );
-}
-
-BF_PartHolder *shine_BF_LoadHolderFromBitstreamPart( BF_PartHolder *theHolder, BF_BitstreamPart *thePart )
-{
-  BF_BitstreamElement *pElem;
-  int i;
-
-  theHolder->part->nrEntries = 0;
-  for ( i = 0; i < thePart->nrEntries; i++ )
+  fb->ThisFrameSize = si->frameLength;
+  for (i = 0; i < si->SILength; i += 32)
     {
-      pElem = &(thePart->element[i]);
-      theHolder = shine_BF_addElement( theHolder, pElem );
+      word = (uint32_t)(si->si[i >> 6] >> (32 - (i & 32)));
+      n = si->SILength - i < 32 ? si->SILength - i : 32;
+      shine_putbits( &config->bs, word >> (32 - n), n);
     }
-  return theHolder;
-}
-
-/* Grow or shrink a part holder. Always creates a new one of the right length
-  and frees the old one after copying the data. */
-BF_PartHolder *shine_BF_resizePartHolder( BF_PartHolder *oldPH, int max_elements )
-{
-  int elems, i;
-  BF_PartHolder *newPH;
-
-#ifdef DEBUG
-  printf("Resizing part holder from %d to %d\n", oldPH->max_elements, max_elements );
-#endif
-  /* create new holder of the right length */
-  newPH = shine_BF_newPartHolder( max_elements );
-
-  /* copy values from old to new */
-  elems = (oldPH->max_elements > max_elements) ? max_elements : oldPH->max_elements;
-  newPH->part->nrEntries = elems;
-  for ( i = 0; i < elems; i++ )
-    newPH->part->element[i] = oldPH->part->element[i];
-
-  /* free old holder */
-  shine_BF_freePartHolder( oldPH );
-
-  return newPH;
-}
-
-BF_PartHolder *shine_BF_freePartHolder( BF_PartHolder *thePH )
-{
-  free( thePH->part->element );
-  free( thePH->part );
-  free( thePH );
-  return NULL;
-}
-
-/* Add theElement to thePH, growing the holder if necessary. Returns ptr to the
-  holder, which may not be the one you called it with! */
-BF_PartHolder *shine_BF_addElement( BF_PartHolder *thePH, BF_BitstreamElement *theElement )
-{
-  BF_PartHolder *retPH = thePH;
-  int needed_entries = thePH->part->nrEntries + 1;
-  int extraPad = 8;  /* add this many more if we need to resize */
-
-  /* grow if necessary */
-  if ( needed_entries > thePH->max_elements )
-    retPH = shine_BF_resizePartHolder( thePH, needed_entries + extraPad );
-
-  /* copy the data */
-  retPH->part->element[retPH->part->nrEntries++] = *theElement;
-  return retPH;
-}
-
-/* Add a bit value and length to the element list in thePH */
-BF_PartHolder *shine_BF_addEntry( BF_PartHolder *thePH,
-                            unsigned long int value,
-                            unsigned int length )
-{
-  BF_BitstreamElement myElement;
-  myElement.value  = value;
-  myElement.length = length;
-  if ( length )
-    return shine_BF_addElement( thePH, &myElement );
-  else
-    return thePH;
+  return si->SILength;
 }
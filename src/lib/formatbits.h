@@ -23,7 +23,6 @@
 #endif
 
 void shine_formatbits_initialise(shine_global_config *config);
-void shine_formatbits_close(shine_global_config *config);
 
 /*
   The following is a shorthand bitstream syntax for
@@ -57,9 +56,7 @@ MainData()
         {
             Scalefactors();
             CodedData();
-            UserSpectrum();
         }
-    UserFrameData();
 }
 
 */
@@ -68,17 +65,16 @@ MainData()
   public functions in formatBitstream.c
 */
 
-/* count the bits in a BitstreamPart */
-int  shine_BF_PartLength( BF_BitstreamPart *part );
+/* queue the header and side info of a frame, to be filled by the caller */
+MYSideInfo *shine_BF_newSideInfo( int frameLength, shine_global_config *config );
+void shine_BF_addSideInfo( MYSideInfo *si, uint64_t val, unsigned int nbits );
 
-/* encode a frame of audio and write it to your bitstream */
-void shine_BF_BitstreamFrame( shine_global_config *config);
+/* write main data, inserting the queued side info at the frame boundaries */
+void shine_BF_writeMainData( uint64_t val, unsigned int nbits, shine_global_config *config );
 
-BF_PartHolder *shine_BF_newPartHolder( unsigned long int max_elements );
-BF_PartHolder *shine_BF_resizePartHolder( BF_PartHolder *oldPH, int max_elements );
-BF_PartHolder *shine_BF_addElement( BF_PartHolder *thePH, BF_BitstreamElement *theElement );
-BF_PartHolder *shine_BF_addEntry( BF_PartHolder *thePH, unsigned long int value, unsigned int length );
-BF_PartHolder *shine_BF_NewHolderFromBitstreamPart( BF_BitstreamPart *thePart );
-BF_PartHolder *shine_BF_LoadHolderFromBitstreamPart( BF_PartHolder *theHolder, BF_BitstreamPart *thePart );
-BF_PartHolder *shine_BF_freePartHolder( BF_PartHolder *thePH );
+/* pad the main data to the end of the last frame */
+void shine_BF_flush( shine_global_config *config );
+
+/* main_data_begin of the next frame */
+int shine_BF_backPointer( shine_global_config *config );
 #endif
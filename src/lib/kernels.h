@@ -0,0 +1,38 @@
+#ifndef shine_KERNELS_H
+#define shine_KERNELS_H
+
+/* Inner loops of the filterbank, the MDCT and the quantizer.  The plain
+ * C versions are the reference, the SIMD versions produce exactly the
+ * same results and are picked at initialisation time for the cpu the
+ * encoder runs on.
+ */
+
+#include <stdint.h>
+
+#if (defined(__i386__) || defined(__x86_64__)) && !defined(NO_SIMD)
+#define SHINE_X86
+#endif
+
+#define SHINE_CPU_SSE2 1
+#define SHINE_CPU_AVX2 2
+
+#ifdef SHINE_X86
+int shine_cpu_features(void);
+#else
+#define shine_cpu_features() 0
+#endif
+
+void shine_subband_filter_c(int32_t *x, int32_t s[18][SBLIMIT], subband_t *subband);
+void shine_mdct_granule_c(int32_t prev[18][SBLIMIT], int32_t cur[18][SBLIMIT], int32_t out[18][SBLIMIT], mdct_t *mdct);
+void shine_mdct_alias(int32_t out[18][SBLIMIT], int first, mdct_t *mdct);
+int shine_quantize_c(int ix[samp_per_frame2], int stepsize, int n, l3loop_t *l3loop);
+
+#ifdef SHINE_X86
+void shine_subband_filter_sse2(int32_t *x, int32_t s[18][SBLIMIT], subband_t *subband);
+void shine_subband_filter_avx2(int32_t *x, int32_t s[18][SBLIMIT], subband_t *subband);
+void shine_mdct_granule_sse2(int32_t prev[18][SBLIMIT], int32_t cur[18][SBLIMIT], int32_t out[18][SBLIMIT], mdct_t *mdct);
+void shine_mdct_granule_avx2(int32_t prev[18][SBLIMIT], int32_t cur[18][SBLIMIT], int32_t out[18][SBLIMIT], mdct_t *mdct);
+int shine_quantize_avx2(int ix[samp_per_frame2], int stepsize, int n, l3loop_t *l3loop);
+#endif
+
+#endif
@@ -0,0 +1,477 @@
+/* kernels_x86 */
+
+#include "types.h"
+#include "kernels.h"
+
+#ifdef SHINE_X86
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+/* The library is built for the baseline instruction set, only these
+ * functions are compiled for the extensions they use. */
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+/*
+ * shine_cpu_features:
+ * -------------------
+ * Returns the SHINE_CPU_* extensions usable on this cpu.  AVX2 also needs
+ * the OS to save the ymm registers (OSXSAVE and XCR0).
+ */
+int shine_cpu_features(void)
+{
+  unsigned int a, b, c, d, xcr0;
+  int features = 0;
+
+  if (!__get_cpuid(1, &a, &b, &c, &d))
+    return 0;
+
+  if (d & bit_SSE2)
+    features |= SHINE_CPU_SSE2;
+
+  if ((c & bit_OSXSAVE) && (c & bit_AVX) && __get_cpuid_max(0, NULL) >= 7)
+  {
+    __asm__ ("xgetbv" : "=a" (xcr0), "=d" (d) : "c" (0));
+    __cpuid_count(7, 0, a, b, c, d);
+    if ((xcr0 & 6) == 6 && (b & bit_AVX2))
+      features |= SHINE_CPU_AVX2;
+  }
+
+  return features;
+}
+
+/*
+ * mulsh_sse2:
+ * -----------
+ * (a*b) >> s of each signed 32 bit lane, truncated to 32 bits like the
+ * mul (s=32), muls (s=31) and mul27 (s=27) macros.  SSE2 can only
+ * multiply unsigned, so the high halves are corrected for negative
+ * operands.
+ */
+static inline SSE2 __m128i mulsh_sse2(__m128i a, __m128i b, int s)
+{
+  __m128i p0, p1, lo, hi;
+
+  p0 = _mm_mul_epu32(a, b);
+  p1 = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+  p0 = _mm_shuffle_epi32(p0, _MM_SHUFFLE(3,1,2,0));
+  p1 = _mm_shuffle_epi32(p1, _MM_SHUFFLE(3,1,2,0));
+  lo = _mm_unpacklo_epi32(p0, p1);
+  hi = _mm_unpackhi_epi32(p0, p1);
+  hi = _mm_sub_epi32(hi, _mm_and_si128(_mm_srai_epi32(a, 31), b));
+  hi = _mm_sub_epi32(hi, _mm_and_si128(_mm_srai_epi32(b, 31), a));
+
+  if (s == 32)
+    return hi;
+  return _mm_or_si128(_mm_slli_epi32(hi, 32-s), _mm_srli_epi32(lo, s));
+}
+
+/*
+ * mulsh_avx2:
+ * -----------
+ * Same as mulsh_sse2 with the signed multiply of AVX2.
+ */
+static inline AVX2 __m256i mulsh_avx2(__m256i a, __m256i b, int s)
+{
+  __m256i p0, p1;
+
+  p0 = _mm256_mul_epi32(a, b);
+  p1 = _mm256_mul_epi32(_mm256_srli_epi64(a, 32), _mm256_srli_epi64(b, 32));
+
+  return _mm256_blend_epi32(_mm256_srli_epi64(p0, s), _mm256_slli_epi64(p1, 32-s), 0xaa);
+}
+
+/*
+ * dct_sse2, dct_avx2:
+ * -------------------
+ * subband_dct of l3subband.c on 4 or 8 time slots at once, a[k] holds
+ * input k of each slot.
+ */
+static SSE2 void dct_sse2(__m128i *a, int n, int32_t *c)
+{
+  __m128i even[SBLIMIT/2], odd[SBLIMIT/2], o;
+  int i, h = n>>1;
+
+  if (n == 1)
+    return;
+
+  for (i=0; i<h; i++)
+  {
+    even[i] = a[i<<1];
+    odd[i]  = i ? _mm_add_epi32(a[(i<<1)+1], a[(i<<1)-1]) : a[1];
+  }
+  dct_sse2(even, h, c);
+  dct_sse2(odd,  h, c);
+
+  for (i=0; i<h; i++)
+  {
+    o = mulsh_sse2(odd[i], _mm_set1_epi32(c[h-1+i]), 27);
+    a[i]     = _mm_add_epi32(even[i], o);
+    a[n-1-i] = _mm_sub_epi32(even[i], o);
+  }
+}
+
+static AVX2 void dct_avx2(__m256i *a, int n, int32_t *c)
+{
+  __m256i even[SBLIMIT/2], odd[SBLIMIT/2], o;
+  int i, h = n>>1;
+
+  if (n == 1)
+    return;
+
+  for (i=0; i<h; i++)
+  {
+    even[i] = a[i<<1];
+    odd[i]  = i ? _mm256_add_epi32(a[(i<<1)+1], a[(i<<1)-1]) : a[1];
+  }
+  dct_avx2(even, h, c);
+  dct_avx2(odd,  h, c);
+
+  for (i=0; i<h; i++)
+  {
+    o = mulsh_avx2(odd[i], _mm256_set1_epi32(c[h-1+i]), 27);
+    a[i]     = _mm256_add_epi32(even[i], o);
+    a[n-1-i] = _mm256_sub_epi32(even[i], o);
+  }
+}
+
+/*
+ * shine_subband_filter_sse2, shine_subband_filter_avx2:
+ * -----------------------------------------------------
+ * shine_subband_filter_c with the 64 window sums of a slot computed 4 or
+ * 8 at a time, and the DCT-32 run across 4 or 8 slots at once on the
+ * folded values stored slot interleaved in #f# (padded to a multiple of
+ * the vector width).  The window sums are stored in time order, y[i] here
+ * is y[63-i] of the C kernel.
+ */
+void SSE2 shine_subband_filter_sse2(int32_t *x, int32_t s[18][SBLIMIT], subband_t *subband)
+{
+  int32_t y[64], f[SBLIMIT][20];
+  __m128i a[SBLIMIT], acc;
+  int i, j, t;
+
+  for (t=0; t<18; t++, x+=32)
+  {
+    for (i=0; i<64; i+=4)
+    {
+      acc = _mm_setzero_si128();
+      for (j=0; j<HAN_SIZE; j+=64)
+        acc = _mm_add_epi32(acc, mulsh_sse2(_mm_loadu_si128((__m128i *)(x+i+j)),
+                                            _mm_loadu_si128((__m128i *)(subband->ew+i+j)), 32));
+      _mm_storeu_si128((__m128i *)(y+i), acc);
+    }
+
+    f[0][t]  = y[47];
+    f[16][t] = y[31] + y[63];
+    for (i=1; i<16; i++)
+    {
+      f[i][t]    = y[47-i] + y[47+i];
+      f[i+16][t] = y[31-i] - y[i-1];
+    }
+  }
+  for (i=SBLIMIT; i--; )
+    f[i][18] = f[i][19] = 0;
+
+  for (t=0; t<20; t+=4)
+  {
+    for (i=SBLIMIT; i--; )
+      a[i] = _mm_loadu_si128((__m128i *)&f[i][t]);
+    dct_sse2(a, SBLIMIT, subband->dct);
+    for (i=SBLIMIT; i--; )
+      _mm_storeu_si128((__m128i *)&f[i][t], _mm_srai_epi32(a[i], 1));
+  }
+
+  for (t=18; t--; )
+    for (i=SBLIMIT; i--; )
+      s[t][i] = f[i][t];
+}
+
+void AVX2 shine_subband_filter_avx2(int32_t *x, int32_t s[18][SBLIMIT], subband_t *subband)
+{
+  int32_t y[64], f[SBLIMIT][24];
+  __m256i a[SBLIMIT], acc;
+  int i, j, t;
+
+  for (t=0; t<18; t++, x+=32)
+  {
+    for (i=0; i<64; i+=8)
+    {
+      acc = _mm256_setzero_si256();
+      for (j=0; j<HAN_SIZE; j+=64)
+        acc = _mm256_add_epi32(acc, mulsh_avx2(_mm256_loadu_si256((__m256i *)(x+i+j)),
+                                               _mm256_loadu_si256((__m256i *)(subband->ew+i+j)), 32));
+      _mm256_storeu_si256((__m256i *)(y+i), acc);
+    }
+
+    f[0][t]  = y[47];
+    f[16][t] = y[31] + y[63];
+    for (i=1; i<16; i++)
+    {
+      f[i][t]    = y[47-i] + y[47+i];
+      f[i+16][t] = y[31-i] - y[i-1];
+    }
+  }
+  for (i=SBLIMIT; i--; )
+    for (t=18; t<24; t++)
+      f[i][t] = 0;
+
+  for (t=0; t<24; t+=8)
+  {
+    for (i=SBLIMIT; i--; )
+      a[i] = _mm256_loadu_si256((__m256i *)&f[i][t]);
+    dct_avx2(a, SBLIMIT, subband->dct);
+    for (i=SBLIMIT; i--; )
+      _mm256_storeu_si256((__m256i *)&f[i][t], _mm256_srai_epi32(a[i], 1));
+  }
+
+  for (t=18; t--; )
+    for (i=SBLIMIT; i--; )
+      s[t][i] = f[i][t];
+}
+
+/*
+ * dct9_sse2, dct9_avx2:
+ * ---------------------
+ * dct9 of l3mdct.c on 4 or 8 bands at once.
+ */
+static SSE2 void dct9_sse2(__m128i a[9], int32_t c[8][4])
+{
+  __m128i ev, od, x[9];
+  int i;
+
+  for (i=9; i--; )
+    x[i] = a[i];
+
+  for (i=4; i--; )
+  {
+    ev = _mm_add_epi32(x[0], mulsh_sse2(x[2], _mm_set1_epi32(c[1][i]), 31));
+    ev = _mm_add_epi32(ev,   mulsh_sse2(x[4], _mm_set1_epi32(c[3][i]), 31));
+    ev = _mm_add_epi32(ev,   mulsh_sse2(x[6], _mm_set1_epi32(c[5][i]), 31));
+    ev = _mm_add_epi32(ev,   mulsh_sse2(x[8], _mm_set1_epi32(c[7][i]), 31));
+    od = mulsh_sse2(x[1], _mm_set1_epi32(c[0][i]), 31);
+    od = _mm_add_epi32(od, mulsh_sse2(x[3], _mm_set1_epi32(c[2][i]), 31));
+    od = _mm_add_epi32(od, mulsh_sse2(x[5], _mm_set1_epi32(c[4][i]), 31));
+    od = _mm_add_epi32(od, mulsh_sse2(x[7], _mm_set1_epi32(c[6][i]), 31));
+    a[i]   = _mm_add_epi32(ev, od);
+    a[8-i] = _mm_sub_epi32(ev, od);
+  }
+  a[4] = _mm_add_epi32(_mm_sub_epi32(_mm_add_epi32(_mm_sub_epi32(x[0], x[2]), x[4]), x[6]), x[8]);
+}
+
+static AVX2 void dct9_avx2(__m256i a[9], int32_t c[8][4])
+{
+  __m256i ev, od, x[9];
+  int i;
+
+  for (i=9; i--; )
+    x[i] = a[i];
+
+  for (i=4; i--; )
+  {
+    ev = _mm256_add_epi32(x[0], mulsh_avx2(x[2], _mm256_set1_epi32(c[1][i]), 31));
+    ev = _mm256_add_epi32(ev,   mulsh_avx2(x[4], _mm256_set1_epi32(c[3][i]), 31));
+    ev = _mm256_add_epi32(ev,   mulsh_avx2(x[6], _mm256_set1_epi32(c[5][i]), 31));
+    ev = _mm256_add_epi32(ev,   mulsh_avx2(x[8], _mm256_set1_epi32(c[7][i]), 31));
+    od = mulsh_avx2(x[1], _mm256_set1_epi32(c[0][i]), 31);
+    od = _mm256_add_epi32(od, mulsh_avx2(x[3], _mm256_set1_epi32(c[2][i]), 31));
+    od = _mm256_add_epi32(od, mulsh_avx2(x[5], _mm256_set1_epi32(c[4][i]), 31));
+    od = _mm256_add_epi32(od, mulsh_avx2(x[7], _mm256_set1_epi32(c[6][i]), 31));
+    a[i]   = _mm256_add_epi32(ev, od);
+    a[8-i] = _mm256_sub_epi32(ev, od);
+  }
+  a[4] = _mm256_add_epi32(_mm256_sub_epi32(_mm256_add_epi32(_mm256_sub_epi32(x[0], x[2]), x[4]), x[6]), x[8]);
+}
+
+/*
+ * shine_mdct_granule_sse2, shine_mdct_granule_avx2:
+ * -------------------------------------------------
+ * shine_mdct_granule_c on 4 or 8 neighbouring bands at once, the band
+ * interleaved layout makes every step a plain vector load or store.
+ * The aliasing butterflies of the bands left over at the top are done
+ * by shine_mdct_alias.
+ */
+void SSE2 shine_mdct_granule_sse2(int32_t prev[18][SBLIMIT], int32_t cur[18][SBLIMIT], int32_t out[18][SBLIMIT], mdct_t *mdct)
+{
+  __m128i x[36], u[18], e[9], o[9], t, a, b, cs, ca;
+  int band, i;
+
+  for (band=0; band<SBLIMIT; band+=4)
+  {
+    /* the Q29 window leaves two guard bits, see mdct_long */
+    for (i=18; i--; )
+    {
+      x[i]    = mulsh_sse2(_mm_loadu_si128((__m128i *)&prev[i][band]), _mm_loadu_si128((__m128i *)mdct->win[i]), 32);
+      x[i+18] = mulsh_sse2(_mm_loadu_si128((__m128i *)&cur[i][band]), _mm_loadu_si128((__m128i *)mdct->win[i+18]), 32);
+    }
+
+    /* fold (a,b,c,d) to (-c'-d, a-b') and sum pairwise */
+    for (i=9; i--; )
+    {
+      u[i]   = _mm_sub_epi32(_mm_sub_epi32(_mm_setzero_si128(), x[26-i]), x[27+i]);
+      u[i+9] = _mm_sub_epi32(x[i], x[17-i]);
+    }
+    for (i=17; i; i--)
+      u[i] = _mm_add_epi32(u[i], u[i-1]);
+
+    /* 18 point DCT-III as two 9 point ones */
+    for (i=9; i--; )
+    {
+      e[i] = u[i<<1];
+      o[i] = i ? _mm_add_epi32(u[(i<<1)+1], u[(i<<1)-1]) : u[1];
+    }
+    dct9_sse2(e, mdct->cos9);
+    dct9_sse2(o, mdct->cos9);
+
+    for (i=9; i--; )
+    {
+      t = mulsh_sse2(o[i], _mm_set1_epi32(mdct->sc9[i]), 27);
+      _mm_storeu_si128((__m128i *)&out[i][band],
+                       mulsh_sse2(_mm_add_epi32(e[i], t), _mm_set1_epi32(mdct->sc18[i]), 26));
+      _mm_storeu_si128((__m128i *)&out[17-i][band],
+                       mulsh_sse2(_mm_sub_epi32(e[i], t), _mm_set1_epi32(mdct->sc18[17-i]), 26));
+    }
+  }
+
+  for (i=8; i--; )
+  {
+    cs = _mm_set1_epi32(mdct->cs[i]);
+    ca = _mm_set1_epi32(mdct->ca[i]);
+    for (band=0; band<=31-4; band+=4)
+    {
+      a = _mm_loadu_si128((__m128i *)&out[17-i][band]);
+      b = _mm_loadu_si128((__m128i *)&out[i][band+1]);
+      _mm_storeu_si128((__m128i *)&out[17-i][band],
+                       _mm_add_epi32(mulsh_sse2(a, cs, 31), mulsh_sse2(b, ca, 31)));
+      _mm_storeu_si128((__m128i *)&out[i][band+1],
+                       _mm_sub_epi32(mulsh_sse2(b, cs, 31), mulsh_sse2(a, ca, 31)));
+    }
+  }
+  shine_mdct_alias(out, band, mdct);
+}
+
+void AVX2 shine_mdct_granule_avx2(int32_t prev[18][SBLIMIT], int32_t cur[18][SBLIMIT], int32_t out[18][SBLIMIT], mdct_t *mdct)
+{
+  __m256i x[36], u[18], e[9], o[9], t, a, b, cs, ca;
+  int band, i;
+
+  for (band=0; band<SBLIMIT; band+=8)
+  {
+    /* the Q29 window leaves two guard bits, see mdct_long */
+    for (i=18; i--; )
+    {
+      x[i]    = mulsh_avx2(_mm256_loadu_si256((__m256i *)&prev[i][band]), _mm256_loadu_si256((__m256i *)mdct->win[i]), 32);
+      x[i+18] = mulsh_avx2(_mm256_loadu_si256((__m256i *)&cur[i][band]), _mm256_loadu_si256((__m256i *)mdct->win[i+18]), 32);
+    }
+
+    /* fold (a,b,c,d) to (-c'-d, a-b') and sum pairwise */
+    for (i=9; i--; )
+    {
+      u[i]   = _mm256_sub_epi32(_mm256_sub_epi32(_mm256_setzero_si256(), x[26-i]), x[27+i]);
+      u[i+9] = _mm256_sub_epi32(x[i], x[17-i]);
+    }
+    for (i=17; i; i--)
+      u[i] = _mm256_add_epi32(u[i], u[i-1]);
+
+    /* 18 point DCT-III as two 9 point ones */
+    for (i=9; i--; )
+    {
+      e[i] = u[i<<1];
+      o[i] = i ? _mm256_add_epi32(u[(i<<1)+1], u[(i<<1)-1]) : u[1];
+    }
+    dct9_avx2(e, mdct->cos9);
+    dct9_avx2(o, mdct->cos9);
+
+    for (i=9; i--; )
+    {
+      t = mulsh_avx2(o[i], _mm256_set1_epi32(mdct->sc9[i]), 27);
+      _mm256_storeu_si256((__m256i *)&out[i][band],
+                          mulsh_avx2(_mm256_add_epi32(e[i], t), _mm256_set1_epi32(mdct->sc18[i]), 26));
+      _mm256_storeu_si256((__m256i *)&out[17-i][band],
+                          mulsh_avx2(_mm256_sub_epi32(e[i], t), _mm256_set1_epi32(mdct->sc18[17-i]), 26));
+    }
+  }
+
+  for (i=8; i--; )
+  {
+    cs = _mm256_set1_epi32(mdct->cs[i]);
+    ca = _mm256_set1_epi32(mdct->ca[i]);
+    for (band=0; band<=31-8; band+=8)
+    {
+      a = _mm256_loadu_si256((__m256i *)&out[17-i][band]);
+      b = _mm256_loadu_si256((__m256i *)&out[i][band+1]);
+      _mm256_storeu_si256((__m256i *)&out[17-i][band],
+                          _mm256_add_epi32(mulsh_avx2(a, cs, 31), mulsh_avx2(b, ca, 31)));
+      _mm256_storeu_si256((__m256i *)&out[i][band+1],
+                          _mm256_sub_epi32(mulsh_avx2(b, cs, 31), mulsh_avx2(a, ca, 31)));
+    }
+  }
+  shine_mdct_alias(out, band, mdct);
+}
+
+/*
+ * quantize_float:
+ * ---------------
+ * shine_quantize_c for the values outside the int2idx table.
+ */
+static int quantize_float(int32_t xrabs, double scale)
+{
+  double dbl;
+
+  dbl = ((double)xrabs) * scale * 4.656612875e-10; /* 0x7fffffff */
+  return (int)sqrt(sqrt(dbl)*dbl); /* dbl**(3/4) */
+}
+
+/*
+ * shine_quantize_avx2:
+ * --------------------
+ * shine_quantize_c with the rounded multiplies, the int2idx look ups and
+ * the maximum done 8 at a time.  Both operands are positive, so the
+ * unsigned multiply gives mulr directly.  The rare values beyond the
+ * table are patched in afterwards.
+ * There is no SSE2 version, without a gather the look ups dominate and
+ * it is no faster than the C one.
+ */
+int AVX2 shine_quantize_avx2(int ix[samp_per_frame2], int stepsize, int n, l3loop_t *l3loop)
+{
+  __m256i scalei, round, limit, p0, p1, v, ln, max;
+  int32_t l[8], m[8];
+  double scale = l3loop->steptab[stepsize+127];
+  int i, k;
+
+  scalei = _mm256_set1_epi32(l3loop->steptabi[stepsize+127]);
+  round  = _mm256_set1_epi64x(0x80000000);
+  limit  = _mm256_set1_epi32(9999);
+  max    = _mm256_setzero_si256();
+
+  for (i=0; i<n; i+=8)
+  {
+    v  = _mm256_loadu_si256((__m256i *)(l3loop->xrabs+i));
+    p0 = _mm256_add_epi64(_mm256_mul_epu32(v, scalei), round);
+    p1 = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(v, 32), scalei), round);
+    ln = _mm256_blend_epi32(_mm256_srli_epi64(p0, 32), p1, 0xaa);
+
+    v = _mm256_i32gather_epi32((const int *)l3loop->int2idx, _mm256_min_epi32(ln, limit), 4);
+    if (!_mm256_testz_si256(_mm256_cmpgt_epi32(ln, limit), _mm256_set1_epi32(-1)))
+    {
+      _mm256_storeu_si256((__m256i *)l, ln);
+      _mm256_storeu_si256((__m256i *)(ix+i), v);
+      for (k=0; k<8; k++)
+        if (l[k] >= 10000)
+          ix[i+k] = quantize_float(l3loop->xrabs[i+k], scale);
+      v = _mm256_loadu_si256((__m256i *)(ix+i));
+    }
+    else
+      _mm256_storeu_si256((__m256i *)(ix+i), v);
+
+    max = _mm256_max_epi32(max, v);
+  }
+
+  _mm256_storeu_si256((__m256i *)m, max);
+  for (k=1; k<8; k++)
+    if (m[0] < m[k])
+      m[0] = m[k];
+  return m[0];
+}
+
+#endif
@@ -9,54 +9,9 @@
 #include "tables.h"
 #include "l3bitstream.h" /* the public interface */
 
-int shine_HuffmanCode(int table_select, int x, int y, unsigned int *code,
-                unsigned int *ext, int *cbits, int *xbits );
-
-void shine_bitstream_initialise( shine_global_config *config )
-{
-  int ch, gr;
-
-  config->l3stream.headerPH = shine_BF_newPartHolder( 12 );
-  config->l3stream.frameSIPH = shine_BF_newPartHolder( 12 );
-
-  for ( ch = 0; ch < MAX_CHANNELS; ch++ )
-     config->l3stream.channelSIPH[ch] = shine_BF_newPartHolder( 8 );
-
-  for ( gr = 0; gr < MAX_GRANULES; gr++ )
-    for ( ch = 0; ch < MAX_CHANNELS; ch++ )
-      {
-       config->l3stream.spectrumSIPH[gr][ch]   = shine_BF_newPartHolder( 32 );
-       config->l3stream.scaleFactorsPH[gr][ch] = shine_BF_newPartHolder( 64 );
-       config->l3stream.codedDataPH[gr][ch]    = shine_BF_newPartHolder( samp_per_frame2 );
-       config->l3stream.userSpectrumPH[gr][ch] = shine_BF_newPartHolder( 4 );
-      }
-  config->l3stream.userFrameDataPH = shine_BF_newPartHolder( 8 );
-}
-
-void shine_bitstream_close( shine_global_config *config )
-{
-  int ch, gr;
-
-  shine_BF_freePartHolder(config->l3stream.headerPH);
-  shine_BF_freePartHolder(config->l3stream.frameSIPH);
-
-  for ( ch = 0; ch < MAX_CHANNELS; ch++ )
-     shine_BF_freePartHolder(config->l3stream.channelSIPH[ch]);
-
-  for ( gr = 0; gr < MAX_GRANULES; gr++ )
-    for ( ch = 0; ch < MAX_CHANNELS; ch++ )
-      {
-       shine_BF_freePartHolder(config->l3stream.spectrumSIPH[gr][ch]);
-       shine_BF_freePartHolder(config->l3stream.scaleFactorsPH[gr][ch]);
-       shine_BF_freePartHolder(config->l3stream.codedDataPH[gr][ch]);
-       shine_BF_freePartHolder(config->l3stream.userSpectrumPH[gr][ch]);
-      }
-  shine_BF_freePartHolder(config->l3stream.userFrameDataPH);
-}
-
-static int encodeSideInfo( shine_global_config *config );
+static void encodeSideInfo( shine_global_config *config );
 static void encodeMainData( shine_global_config *config );
-static void Huffmancodebits( BF_PartHolder **pph, int *ix, gr_info *gi , shine_global_config *config);
+static void Huffmancodebits( int *ix, gr_info *gi , shine_global_config *config);
 
 /*
   shine_format_bitstream()
@@ -67,19 +22,21 @@ static void Huffmancodebits( BF_PartHolder **pph, int *ix, gr_info *gi , shine_g
   a series of main_data() blocks, with header and side information
   inserted at the proper locations to maintain framing. (See Figure A.7
   in the IS).
+  The codewords go straight to the bitstream, the header and side
+  information are queued and inserted when the main data reaches the
+  frame's position.
 */
 
 void
 shine_format_bitstream(shine_global_config *config)
 {
   int gr, ch, i;
-  BF_FrameData *frameData = &config->l3stream.frameData;
 
   for ( gr = 0; gr < 2; gr++ )
     for ( ch =  0; ch < config->wave.channels; ch++ )
       {
         int *pi = &config->l3_enc[gr][ch][0];
-        long *pr = &config->mdct_freq[gr][ch][0];
+        int32_t *pr = &config->mdct_freq[gr][ch][0];
         for ( i = 0; i < samp_per_frame2; i++, pr++, pi++ )
           {
             if ( (*pr < 0) && (*pi > 0) )
@@ -90,29 +47,8 @@ shine_format_bitstream(shine_global_config *config)
   encodeSideInfo( config );
   encodeMainData( config );
 
-  frameData->frameLength = config->mpeg.bits_per_frame;
-  frameData->nGranules   = 2;
-  frameData->nChannels   = config->wave.channels;
-  frameData->header      = config->l3stream.headerPH->part;
-  frameData->frameSI     = config->l3stream.frameSIPH->part;
-
-  for ( ch = 0; ch < config->wave.channels; ch++ )
-    frameData->channelSI[ch] = config->l3stream.channelSIPH[ch]->part;
-
-  for ( gr = 0; gr < 2; gr++ )
-    for ( ch = 0; ch < config->wave.channels; ch++ )
-      {
-        frameData->spectrumSI[gr][ch]   = config->l3stream.spectrumSIPH[gr][ch]->part;
-        frameData->scaleFactors[gr][ch] = config->l3stream.scaleFactorsPH[gr][ch]->part;
-        frameData->codedData[gr][ch]    = config->l3stream.codedDataPH[gr][ch]->part;
-        frameData->userSpectrum[gr][ch] = config->l3stream.userSpectrumPH[gr][ch]->part;
-      }
-  frameData->userFrameData = config->l3stream.userFrameDataPH->part;
-
-  shine_BF_BitstreamFrame(config);
-
   /* we set this here -- it will be tested in the next loops iteration */
-  config->side_info.main_data_begin = config->l3stream.frameResults.nextBackPtr;
+  config->side_info.main_data_begin = shine_BF_backPointer( config );
 }
 
 static unsigned slen1_tab[16] = { 0, 0, 0, 0, 3, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4 };
@@ -121,207 +57,201 @@ static unsigned slen2_tab[16] = { 0, 1, 2, 3, 0, 1, 2, 3, 1, 2, 3, 1, 2, 3, 2, 3
 static void encodeMainData(shine_global_config *config)
 {
   int gr, ch, sfb;
-  shine_side_info_t  si = config->side_info;
-
-  for ( gr = 0; gr < 2; gr++ )
-    for ( ch = 0; ch < config->wave.channels; ch++ )
-      {
-        config->l3stream.scaleFactorsPH[gr][ch]->part->nrEntries = 0;
-        config->l3stream.codedDataPH[gr][ch]->part->nrEntries = 0;
-      }
-
-
+  shine_side_info_t *si = &config->side_info;
 
   for ( gr = 0; gr < 2; gr++ )
     {
       for ( ch = 0; ch < config->wave.channels; ch++ )
         {
-          BF_PartHolder **pph = &config->l3stream.scaleFactorsPH[gr][ch];
-          gr_info *gi = &(si.gr[gr].ch[ch].tt);
+          gr_info *gi = &(si->gr[gr].ch[ch].tt);
           unsigned slen1 = slen1_tab[ gi->scalefac_compress ];
           unsigned slen2 = slen2_tab[ gi->scalefac_compress ];
           int *ix = &config->l3_enc[gr][ch][0];
 
-          if ( (gr == 0) || (si.scfsi[ch][0] == 0) )
+          if ( (gr == 0) || (si->scfsi[ch][0] == 0) )
             for ( sfb = 0; sfb < 6; sfb++ )
-              *pph = shine_BF_addEntry( *pph,  config->scalefactor.l[gr][ch][sfb], slen1 );
+              shine_BF_writeMainData( config->scalefactor.l[gr][ch][sfb], slen1, config );
 
-          if ( (gr == 0) || (si.scfsi[ch][1] == 0) )
+          if ( (gr == 0) || (si->scfsi[ch][1] == 0) )
             for ( sfb = 6; sfb < 11; sfb++ )
-              *pph = shine_BF_addEntry( *pph,  config->scalefactor.l[gr][ch][sfb], slen1 );
+              shine_BF_writeMainData( config->scalefactor.l[gr][ch][sfb], slen1, config );
 
-          if ( (gr == 0) || (si.scfsi[ch][2] == 0) )
+          if ( (gr == 0) || (si->scfsi[ch][2] == 0) )
             for ( sfb = 11; sfb < 16; sfb++ )
-              *pph = shine_BF_addEntry( *pph,  config->scalefactor.l[gr][ch][sfb], slen2 );
+              shine_BF_writeMainData( config->scalefactor.l[gr][ch][sfb], slen2, config );
 
-          if ( (gr == 0) || (si.scfsi[ch][3] == 0) )
+          if ( (gr == 0) || (si->scfsi[ch][3] == 0) )
             for ( sfb = 16; sfb < 21; sfb++ )
-              *pph = shine_BF_addEntry( *pph,  config->scalefactor.l[gr][ch][sfb], slen2 );
+              shine_BF_writeMainData( config->scalefactor.l[gr][ch][sfb], slen2, config );
 
-          Huffmancodebits( &config->l3stream.codedDataPH[gr][ch], ix, gi, config );
+          Huffmancodebits( ix, gi, config );
         }
     }
+
+  /* the stuffing bits the granules could not hold go to ancillary data */
+  while ( si->resvDrain > 0 )
+    {
+      int n = si->resvDrain < 32 ? si->resvDrain : 32;
+      shine_BF_writeMainData( 0, n, config );
+      si->resvDrain -= n;
+    }
 }
 
 //static unsigned int crc = 0;
 
-static int encodeSideInfo( shine_global_config *config )
+static void encodeSideInfo( shine_global_config *config )
 {
-  int gr, ch, scfsi_band, region, bits_sent;
-  shine_side_info_t  si = config->side_info;
-
-  config->l3stream.headerPH->part->nrEntries = 0;
-  config->l3stream.headerPH = shine_BF_addEntry( config->l3stream.headerPH, 0xfff,                          12 );
-  config->l3stream.headerPH = shine_BF_addEntry( config->l3stream.headerPH, 1,                               1 );
-  config->l3stream.headerPH = shine_BF_addEntry( config->l3stream.headerPH, 1,                               2 );
-  config->l3stream.headerPH = shine_BF_addEntry( config->l3stream.headerPH, !config->mpeg.crc,               1 );
-  config->l3stream.headerPH = shine_BF_addEntry( config->l3stream.headerPH, config->mpeg.bitrate_index,      4 );
-  config->l3stream.headerPH = shine_BF_addEntry( config->l3stream.headerPH, config->mpeg.samplerate_index,   2 );
-  config->l3stream.headerPH = shine_BF_addEntry( config->l3stream.headerPH, config->mpeg.padding,            1 );
-  config->l3stream.headerPH = shine_BF_addEntry( config->l3stream.headerPH, config->mpeg.ext,                1 );
-  config->l3stream.headerPH = shine_BF_addEntry( config->l3stream.headerPH, config->mpeg.mode,               2 );
-  config->l3stream.headerPH = shine_BF_addEntry( config->l3stream.headerPH, config->mpeg.mode_ext,           2 );
-  config->l3stream.headerPH = shine_BF_addEntry( config->l3stream.headerPH, config->mpeg.copyright,          1 );
-  config->l3stream.headerPH = shine_BF_addEntry( config->l3stream.headerPH, config->mpeg.original,           1 );
-  config->l3stream.headerPH = shine_BF_addEntry( config->l3stream.headerPH, config->mpeg.emph,               2 );
-
-  bits_sent = 32;
-
-  config->l3stream.frameSIPH->part->nrEntries = 0;
-
-  for (ch = 0; ch < config->wave.channels; ch++ )
-    config->l3stream.channelSIPH[ch]->part->nrEntries = 0;
+  int gr, ch, scfsi_band, nbits;
+  uint64_t w;
+  shine_side_info_t *si = &config->side_info;
+  MYSideInfo *p = shine_BF_newSideInfo( config->mpeg.bits_per_frame, config );
 
-  for ( gr = 0; gr < 2; gr++ )
-    for ( ch = 0; ch < config->wave.channels; ch++ )
-      config->l3stream.spectrumSIPH[gr][ch]->part->nrEntries = 0;
-
-  config->l3stream.frameSIPH = shine_BF_addEntry( config->l3stream.frameSIPH, si.main_data_begin, 9 );
+  shine_BF_addSideInfo( p, config->mpeg.header[config->mpeg.padding] |
+                           (config->mpeg.bitrate_index << 12) | (config->mpeg.mode_ext << 4), 32 );
 
+  w = si->main_data_begin;
   if ( config->wave.channels == 2 )
-    config->l3stream.frameSIPH = shine_BF_addEntry( config->l3stream.frameSIPH, si.private_bits, 3 );
+    w = (w << 3) | si->private_bits;
   else
-    config->l3stream.frameSIPH = shine_BF_addEntry( config->l3stream.frameSIPH, si.private_bits, 5 );
-
+    w = (w << 5) | si->private_bits;
   for ( ch = 0; ch < config->wave.channels; ch++ )
     for ( scfsi_band = 0; scfsi_band < 4; scfsi_band++ )
-      {
-        BF_PartHolder **pph = &config->l3stream.channelSIPH[ch];
-        *pph = shine_BF_addEntry( *pph, si.scfsi[ch][scfsi_band], 1 );
-      }
+      w = (w << 1) | si->scfsi[ch][scfsi_band];
+  nbits = config->wave.channels == 2 ? 9 + 3 + 8 : 9 + 5 + 4;
+  shine_BF_addSideInfo( p, w, nbits );
 
+  /* the 59 bits of a granule, window_switching_flag is always 0 */
   for ( gr = 0; gr < 2; gr++ )
     for ( ch = 0; ch < config->wave.channels ; ch++ )
       {
-        BF_PartHolder **pph = &config->l3stream.spectrumSIPH[gr][ch];
-        gr_info *gi = &(si.gr[gr].ch[ch].tt);
-        *pph = shine_BF_addEntry( *pph, gi->part2_3_length,        12 );
-        *pph = shine_BF_addEntry( *pph, gi->big_values,            9 );
-        *pph = shine_BF_addEntry( *pph, gi->global_gain,           8 );
-        *pph = shine_BF_addEntry( *pph, gi->scalefac_compress,     4 );
-        *pph = shine_BF_addEntry( *pph, 0, 1 );
-
-        for ( region = 0; region < 3; region++ )
-          *pph = shine_BF_addEntry( *pph, gi->table_select[region], 5 );
-
-        *pph = shine_BF_addEntry( *pph, gi->region0_count, 4 );
-        *pph = shine_BF_addEntry( *pph, gi->region1_count, 3 );
-
-        *pph = shine_BF_addEntry( *pph, gi->preflag,            1 );
-        *pph = shine_BF_addEntry( *pph, gi->scalefac_scale,     1 );
-        *pph = shine_BF_addEntry( *pph, gi->count1table_select, 1 );
+        gr_info *gi = &(si->gr[gr].ch[ch].tt);
+        w = gi->part2_3_length;
+        w = (w << 9) | gi->big_values;
+        w = (w << 8) | gi->global_gain;
+        w = (w << 4) | gi->scalefac_compress;
+        w = (w << 1);
+        w = (w << 5) | gi->table_select[0];
+        w = (w << 5) | gi->table_select[1];
+        w = (w << 5) | gi->table_select[2];
+        w = (w << 4) | gi->region0_count;
+        w = (w << 3) | gi->region1_count;
+        w = (w << 1) | gi->preflag;
+        w = (w << 1) | gi->scalefac_scale;
+        w = (w << 1) | gi->count1table_select;
+        shine_BF_addSideInfo( p, w, 59 );
       }
+}
 
-  if ( config->wave.channels == 2 )
-    bits_sent += 256;
-  else
-    bits_sent += 136;
+/*
+ * shine_bitstream_header:
+ * -----------------------
+ * Only the bitrate index (VBR), the padding bit and mode_ext of the frame
+ * header change between frames: the header is kept without and with
+ * padding, the others are added when the frame is written.
+ */
+void shine_bitstream_header( shine_global_config *config )
+{
+  uint32_t h;
+  int padding;
 
-  return bits_sent;
+  for ( padding = 0; padding < 2; padding++ )
+    {
+      h = 0xfff;                                         /* sync */
+      h = (h << 1) | 1;                                  /* MPEG-1 */
+      h = (h << 2) | 1;                                  /* layer III */
+      h = (h << 1) | !config->mpeg.crc;
+      h = (h << 4);                                      /* bitrate_index */
+      h = (h << 2) | config->mpeg.samplerate_index;
+      h = (h << 1) | padding;
+      h = (h << 1) | config->mpeg.ext;
+      h = (h << 2) | config->mpeg.mode;
+      h = (h << 2);                                      /* mode_ext */
+      h = (h << 1) | config->mpeg.copyright;
+      h = (h << 1) | config->mpeg.original;
+      h = (h << 2) | config->mpeg.emph;
+      config->mpeg.header[padding] = h;
+    }
 }
 
 /* Note the discussion of huffmancodebits() on pages 28 and 29 of the IS, as
   well as the definitions of the side information on pages 26 and 27. */
-static void Huffmancodebits( BF_PartHolder **pph, int *ix, gr_info *gi, shine_global_config *config )
+static void Huffmancodebits( int *ix, gr_info *gi, shine_global_config *config )
 {
-  int shine_huffman_coder_count1( BF_PartHolder **pph, struct huffcodetab *h, int v, int w, int x, int y );
-  int bigv_bitcount( int ix[samp_per_frame2], gr_info *cod_info );
-
-  int region1Start;
-  int region2Start;
-  int i, bigvalues, count1End;
-  int v, w, x, y, bits, cbits, xbits, stuffingBits;
-  unsigned int code, ext;
-  struct huffcodetab *h;
-  int bvbits, c1bits, tablezeros, r0, r1, r2, rt, *pr;
+  huffcode_t *hc = &config->huffcode;
+  int *scalefac = &shine_scale_fact_band_index[config->mpeg.samplerate_index+3].l[0];
+  int i, region, bigvalues, count1End, stride, stuffingBits, end[3];
+  unsigned tableindex, linbits, x, y, bits;
+  uint32_t *h, c;
+  uint64_t code;
   int bitsWritten = 0;
-  //int idx = 0;
-  tablezeros = 0;
-  r0 = r1 = r2 = 0;
 
   /* 1: Write the bigvalues */
   bigvalues = gi->big_values <<1;
+  end[0] = MIN( scalefac[ gi->region0_count + 1 ], bigvalues );
+  end[1] = MIN( scalefac[ gi->region0_count + gi->region1_count + 2 ], bigvalues );
+  end[2] = bigvalues;
 
-  int *scalefac = &shine_scale_fact_band_index[config->mpeg.samplerate_index+3].l[0];
-  unsigned scalefac_index = 100;
-
-  scalefac_index = gi->region0_count + 1;
-  region1Start = scalefac[ scalefac_index ];
-  scalefac_index += gi->region1_count + 1;
-  region2Start = scalefac[ scalefac_index ];
-
-  for ( i = 0; i < bigvalues; i += 2 )
+  for ( i = 0, region = 0; region < 3; region++ )
     {
-      unsigned tableindex = 100;
-      /* get table pointer */
-      if ( i < region1Start )
-        {
-          tableindex = gi->table_select[0];
-          pr = &r0;
-        }
-      else
-        if ( i < region2Start )
+      tableindex = gi->table_select[region];
+      h = hc->table[tableindex];
+      stride = hc->stride[tableindex];
+      if ( tableindex == 0 )
+        /* all zero, nothing to write */
+        i = MAX( i, end[region] );
+      else if ( tableindex < 16 )
+        for ( ; i < end[region]; i += 2 )
           {
-            tableindex = gi->table_select[1];
-            pr = &r1;
+            c = h[ ix[i] * stride + ix[i+1] ];
+            shine_BF_writeMainData( c >> 5, c & 31, config );
+            bitsWritten += c & 31;
           }
-        else
-          {
-            tableindex = gi->table_select[2];
-            pr = &r2;
-          }
-      h = &shine_huffman_table[ tableindex ];
-      /* get huffman code */
-      x = ix[i];
-      y = ix[i + 1];
-      if ( tableindex )
-        {
-          bits = shine_HuffmanCode( tableindex, x, y, &code, &ext, &cbits, &xbits );
-          *pph = shine_BF_addEntry( *pph,  code, cbits );
-          *pph = shine_BF_addEntry( *pph,  ext, xbits );
-          bitsWritten += rt = bits;
-          *pr += rt;
-        }
       else
-        {
-          tablezeros += 1;
-          *pr = 0;
+        { /* ESC-table is used, the signs follow the linbits */
+          linbits = shine_huffman_table[tableindex].linbits;
+          for ( ; i < end[region]; i += 2 )
+            {
+              x = abs( ix[i] );
+              y = abs( ix[i+1] );
+              c = h[ MIN(x, 15) * 16 + MIN(y, 15) ];
+              code = c >> 5;
+              bits = c & 31;
+              if ( x )
+                {
+                  if ( x > 14 )
+                    {
+                      code = (code << linbits) | (x - 15);
+                      bits += linbits;
+                    }
+                  code = (code << 1) | (ix[i] < 0);
+                  bits++;
+                }
+              if ( y )
+                {
+                  if ( y > 14 )
+                    {
+                      code = (code << linbits) | (y - 15);
+                      bits += linbits;
+                    }
+                  code = (code << 1) | (ix[i+1] < 0);
+                  bits++;
+                }
+              shine_BF_writeMainData( code, bits, config );
+              bitsWritten += bits;
+            }
         }
     }
-  bvbits = bitsWritten;
 
   /* 2: Write count1 area */
-  h = &shine_huffman_table[gi->count1table_select + 32];
+  h = hc->quad[gi->count1table_select] + 40;
   count1End = bigvalues + (gi->count1 <<2);
   for ( i = bigvalues; i < count1End; i += 4 )
     {
-      v = ix[i];
-      w = ix[i+1];
-      x = ix[i+2];
-      y = ix[i+3];
-      bitsWritten += shine_huffman_coder_count1( pph, h, v, w, x, y );
+      c = h[ ix[i] * 27 + ix[i+1] * 9 + ix[i+2] * 3 + ix[i+3] ];
+      shine_BF_writeMainData( c >> 5, c & 31, config );
+      bitsWritten += c & 31;
     }
-  c1bits = bitsWritten - bvbits;
+
   if ( (stuffingBits = gi->part2_3_length - gi->part2_length - bitsWritten) )
     {
       int stuffingWords = stuffingBits / 32;
@@ -329,140 +259,83 @@ static void Huffmancodebits( BF_PartHolder **pph, int *ix, gr_info *gi, shine_gl
 
       /* Due to the nature of the Huffman code tables, we will pad with ones */
       while ( stuffingWords-- )
-        *pph = shine_BF_addEntry( *pph, ~0, 32 );
+        shine_BF_writeMainData( ~0, 32, config );
       if ( remainingBits )
-        *pph = shine_BF_addEntry( *pph, ~0, remainingBits );
-      bitsWritten += stuffingBits;
+        shine_BF_writeMainData( ~0, remainingBits, config );
     }
 }
 
-int shine_abs_and_sign( int *x )
-{
-  if ( *x > 0 ) return 0;
-  *x *= -1;
-  return 1;
-}
-
-int shine_huffman_coder_count1( BF_PartHolder **pph, struct huffcodetab *h, int v, int w, int x, int y )
+/* Appends the sign bit of #v# to the codeword */
+static uint32_t add_sign( uint32_t c, int v )
 {
-  HUFFBITS huffbits;
-  unsigned int signv, signw, signx, signy, p;
-  int len;
-  int totalBits = 0;
-
-  signv = shine_abs_and_sign( &v );
-  signw = shine_abs_and_sign( &w );
-  signx = shine_abs_and_sign( &x );
-  signy = shine_abs_and_sign( &y );
-
-  p = v + (w << 1) + (x << 2) + (y << 3);
-  huffbits = h->table[p];
-  len = h->hlen[ p ];
-  *pph = shine_BF_addEntry( *pph,  huffbits, len );
-  totalBits += len;
-  if ( v )
-    {
-      *pph = shine_BF_addEntry( *pph,  signv, 1 );
-      totalBits += 1;
-    }
-  if ( w )
-    {
-      *pph = shine_BF_addEntry( *pph,  signw, 1 );
-      totalBits += 1;
-    }
-  if ( x )
-    {
-      *pph = shine_BF_addEntry( *pph,  signx, 1 );
-      totalBits += 1;
-    }
-  if ( y )
-    {
-      *pph = shine_BF_addEntry( *pph,  signy, 1 );
-      totalBits += 1;
-    }
-  return totalBits;
+  if ( v == 0 )
+    return c;
+  return ((c >> 5 << 1 | (v < 0)) << 5) | ((c & 31) + 1);
 }
 
-/* Implements the pseudocode of page 98 of the IS */
-int shine_HuffmanCode(int table_select, int x, int y, unsigned int *code,
-                unsigned int *ext, int *cbits, int *xbits )
+/*
+ * shine_bitstream_initialise:
+ * ---------------------------
+ * Packs the codeword and length of every pair of the big values tables
+ * and every count1 quadruple in a single word, code << 5 | length,
+ * following the pseudocode of page 98 of the IS. Except for the ESC
+ * tables the signs directly follow the codeword and are included, so a
+ * pair or a quadruple takes one lookup and one write.
+ */
+void shine_bitstream_initialise( shine_global_config *config )
 {
-  unsigned signx, signy, linbitsx, linbitsy, linbits, xlen, ylen, idx;
+  huffcode_t *hc = &config->huffcode;
   struct huffcodetab *h;
+  uint32_t *p = hc->pair, c;
+  int t, i, n, x, y, v, w;
 
-  *cbits = 0;
-  *xbits = 0;
-  *code  = 0;
-  *ext   = 0;
-
-  if (table_select==0) return 0;
-
-  signx = shine_abs_and_sign( &x );
-  signy = shine_abs_and_sign( &y );
-  h = &(shine_huffman_table[table_select]);
-  xlen = h->xlen;
-  ylen = h->ylen;
-  linbits = h->linbits;
-  linbitsx = linbitsy = 0;
-
-  if ( table_select > 15 )
-    { /* ESC-table is used */
-      if ( x > 14 )
-        {
-          linbitsx = x - 15;
-          x = 15;
-        }
-      if ( y > 14 )
-        {
-          linbitsy = y - 15;
-          y = 15;
-        }
-
-      idx = (x * ylen) + y;
-      *code  = h->table[idx];
-      *cbits = h->hlen [idx];
-      if ( x > 14 )
-        {
-          *ext   |= linbitsx;
-          *xbits += linbits;
+  for ( t = 0; t < 32; t++ )
+    {
+      h = &shine_huffman_table[t];
+      if ( h->table == NULL )
+        { /* table 0 and the unused ones */
+          hc->table[t]  = NULL;
+          hc->stride[t] = 0;
         }
-      if ( x != 0 )
-        {
-          *ext <<= 1;
-          *ext |= signx;
-          *xbits += 1;
+      else if ( t > 16 && h->table == shine_huffman_table[t-1].table )
+        { /* the ESC tables differ only by their linbits */
+          hc->table[t]  = hc->table[t-1];
+          hc->stride[t] = hc->stride[t-1];
         }
-      if ( y > 14 )
+      else if ( t > 15 )
         {
-          *ext <<= linbits;
-          *ext |= linbitsy;
-          *xbits += linbits;
+          hc->table[t]  = p;
+          hc->stride[t] = 16;
+          for ( i = 0; i < 256; i++ )
+            *p++ = (uint32_t)h->table[i] << 5 | h->hlen[i];
         }
-      if ( y != 0 )
+      else
         {
-          *ext <<= 1;
-          *ext |= signy;
-          *xbits += 1;
+          n = h->xlen - 1;
+          hc->stride[t] = 2 * n + 1;
+          hc->table[t]  = p + n * (2 * n + 1) + n;
+          for ( x = -n; x <= n; x++ )
+            for ( y = -n; y <= n; y++ )
+              {
+                i = abs(x) * h->ylen + abs(y);
+                c = (uint32_t)h->table[i] << 5 | h->hlen[i];
+                *p++ = add_sign( add_sign( c, x ), y );
+              }
         }
     }
-  else
-    { /* No ESC-words */
-      idx = (x * ylen) + y;
-      *code = h->table[idx];
-      *cbits += h->hlen[ idx ];
-      if ( x != 0 )
-        {
-          *code <<= 1;
-          *code |= signx;
-          *cbits += 1;
-        }
-      if ( y != 0 )
+
+  for ( t = 0; t < 2; t++ )
+    {
+      h = &shine_huffman_table[t + 32];
+      for ( i = 0; i < 81; i++ )
         {
-          *code <<= 1;
-          *code |= signy;
-          *cbits += 1;
+          v = i / 27 - 1;
+          w = i / 9 % 3 - 1;
+          x = i / 3 % 3 - 1;
+          y = i % 3 - 1;
+          n = abs(v) + (abs(w) << 1) + (abs(x) << 2) + (abs(y) << 3);
+          c = (uint32_t)h->table[n] << 5 | h->hlen[n];
+          hc->quad[t][i] = add_sign( add_sign( add_sign( add_sign( c, v ), w ), x ), y );
         }
     }
-  return *cbits + *xbits;
 }
-
@@ -1,58 +1,150 @@
 /* l3loop.c */
 
 #include "types.h"
+#include "layer3.h"
 #include "tables.h"
 #include "l3loop.h"
 #include "huffman.h"
 #include "bitstream.h"
 #include "l3bitstream.h"
 #include "reservoir.h"
+#include "kernels.h"
 
 #define e        2.71828182845
 #define CBLIMIT  21
 #define SFB_LMAX 22
 
+/* Step size of the VBR quality target above the granule's peak, see vbr_bitrate */
+#define VBR_STEP -28
+
+/* The perceptual entropy of a granule allows noise PE_SMR (3dB units)
+ * below its mean energy per line, see calc_scfsi */
+#define PE_SMR 4
+
+/* The masking model of calc_xmin, in 3dB units: noise is masked
+ * MASK_SMR below the energy per line of a band, which spreads to the
+ * bands above it falling by MASK_UP per band and to the ones below by
+ * MASK_DOWN */
+#define MASK_SMR  4
+#define MASK_UP   3
+#define MASK_DOWN 9
+
+/* Passes of the outer loop that amplify the bands above their allowed
+ * distortion, see shine_outer_loop */
+#define OUTER_MAX 4
+
+/* The work done at each speed level (mpeg.speed): the passes of the outer
+ * loop, the region splits subdivide searches (0 none, 1 for the final
+ * quantization of a granule only, 2 for all the ones the inner loop
+ * tries), scfsi, and the bandwidth in Hz (0 for all of it) */
+static const struct {
+  int  passes;
+  int  search;
+  int  scfsi;
+  long bandwidth;
+} speed_level[SPEED_MAX+1] =
+{
+  { OUTER_MAX, 2, 1, 0 },
+  { 2,         2, 1, 0 },
+  { 1,         1, 1, 0 },
+  { 1,         0, 0, 16000 },
+};
+
+/* Intensity stereo from about IS_HZ_PER_KBPS * bitrate up, see joint_stereo */
+#define IS_MAX_BITR    64
+#define IS_HZ_PER_KBPS 150
+
 int *scalefac_band_long  = &shine_scale_fact_band_index[3].l[0];
 
+/* The Huffman tables scored by the bit cost index of subdivide, in the
+ * order of the 16 bit fields of hcost.  The last field counts the escapes
+ * of the linbits tables.
+ */
+#define HFIELD_15  12
+#define HFIELD_16  13
+#define HFIELD_24  14
+#define HFIELD_ESC 15
+static const unsigned int htable[HFIELD_ESC] = { 1, 2, 3, 5, 6, 7, 8, 9, 10, 11, 12, 13, 15, 16, 24 };
+
+/* Field k of a packed cost */
+#define hfield(c,k) ((int)((c)[(k)>>2] >> (((k)&3)<<4)) & 0xffff)
+
+/* The scalefactor lengths of scalefac_compress */
+static int slen1_tab[16] = { 0, 0, 0, 0, 3, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4 };
+static int slen2_tab[16] = { 0, 1, 2, 3, 0, 1, 2, 3, 1, 2, 3, 1, 2, 3, 2, 3 };
+
+/* Step size of an unused entry of the quantization cache */
+#define QUANT_NONE 1000
+
+/* The groups of tables of the same size, values 0..xlen-1, as the fields
+ * first..first+n-1.  The first group that fits the maximum value of a
+ * region is tried, larger values use the linbits tables.
+ */
+static const struct {
+  int xlen;
+  int first;
+  int n;
+} hgroup[6] = {
+  { 2,  0, 1 }, /* 1 */
+  { 3,  1, 2 }, /* 2, 3 */
+  { 4,  3, 2 }, /* 5, 6 */
+  { 6,  5, 3 }, /* 7, 8, 9 */
+  { 8,  8, 3 }, /* 10, 11, 12 */
+  {16, 11, 2 }  /* 13, 15 */
+};
+
 static void calc_scfsi(shine_psy_xmin_t *l3_xmin, int ch, int gr, shine_global_config *config);
 static int part2_length(shine_scalefac_t *scalefac, int gr, int ch, shine_side_info_t *si);
-static int bin_search_StepSize(int desired_rate, int ix[samp_per_frame2], gr_info * cod_info, shine_global_config *config);
-static int count_bit(int ix[samp_per_frame2], unsigned int start, unsigned int end, unsigned int table );
-static int bigv_bitcount(int ix[samp_per_frame2], gr_info *gi);
-static int new_choose_table( int ix[samp_per_frame2], unsigned int begin, unsigned int end );
-static void bigv_tab_select( int ix[samp_per_frame2], gr_info *cod_info );
-static void subdivide(gr_info *cod_info);
+static int bin_search_StepSize(int desired_rate, gr_info * cod_info, int gr, int ch, shine_global_config *config);
+static int choose_table( uint64_t cost[4], int max, int *bits );
+static int region_bits( uint64_t cost[][4], int begin, int end, int max, unsigned *table );
+static int split_bits( uint64_t cost[][4], int bmax[], int n, int a, int b, unsigned table[3] );
+static int subdivide( int ix[samp_per_frame2], gr_info *cod_info, int search, shine_global_config *config );
 static int count1_bitcount( int ix[ samp_per_frame2 ], gr_info *cod_info );
 static void calc_runlen( int ix[samp_per_frame2], gr_info *cod_info );
-static void calc_xmin(shine_psy_ratio_t *ratio, gr_info *cod_info, shine_psy_xmin_t *l3_xmin, int gr, int ch );
-static int quantize(int ix[samp_per_frame2], int stepsize, shine_global_config *config);
-static int ix_max( int ix[samp_per_frame2], unsigned int begin, unsigned int end );
+static void calc_xmin(gr_info *cod_info, shine_psy_xmin_t *l3_xmin, int gr, int ch, shine_global_config *config);
+static int calc_noise(int ix[samp_per_frame2], gr_info *cod_info, shine_psy_xmin_t *l3_xmin, int sf[], int over[], int *excess, int gr, int ch, shine_global_config *config);
+static void amplify(int32_t xr[samp_per_frame2], int sf[], shine_global_config *config);
+static quant_t *quantize(int stepsize, shine_global_config *config);
+static void joint_stereo(shine_global_config *config);
+static int frame_need(int offset, shine_global_config *config);
+static void set_bitrate(int i, shine_global_config *config);
+static void vbr_bitrate(shine_global_config *config);
+static void abr_bitrate(shine_global_config *config);
+static void prepare_granule(int gr, int ch, shine_global_config *config);
+static int intensity_bound(int max_bits, int ix[samp_per_frame2], gr_info *cod_info, int gr, shine_global_config *config);
+static int scalefac_compress(int sf[]);
 
 /*
  * shine_inner_loop:
  * ----------
  * The code selects the best quantizerStepSize for a particular set
- * of scalefacs.
+ * of scalefacs, starting from the one found by bin_search_StepSize whose
+ * quantization is still cached.
  */
 int shine_inner_loop(int ix[samp_per_frame2],
                int max_bits, gr_info *cod_info, int gr, int ch,
                shine_global_config *config )
 {
   int bits, c1bits, bvbits;
+  int search = speed_level[config->mpeg.speed].search == 2;
+  quant_t *q;
 
-  if(max_bits<0)
-    cod_info->quantizerStepSize--;
-  do
+  for(;;)
   {
-    while(quantize(ix,++cod_info->quantizerStepSize,config) > 8192); /* within table range? */
-
-    calc_runlen(ix,cod_info);                        /* rzero,count1,big_values*/
-    bits = c1bits = count1_bitcount(ix,cod_info);    /* count1_table selection*/
-    subdivide(cod_info);                             /* bigvalues sfb division */
-    bigv_tab_select(ix,cod_info);                    /* codebook selection*/
-    bits += bvbits = bigv_bitcount( ix, cod_info );  /* bit count */
+    q = quantize(cod_info->quantizerStepSize,config);
+    if(q->max <= 8192) /* within table range? */
+    {
+      calc_runlen(q->ix,cod_info);                        /* rzero,count1,big_values*/
+      bits = c1bits = count1_bitcount(q->ix,cod_info);    /* count1_table selection*/
+      bits += bvbits = subdivide(q->ix,cod_info,search,config); /* bigvalues sfb division, codebook selection and bit count */
+      if(bits<=max_bits)
+        break;
+    }
+    cod_info->quantizerStepSize++;
   }
-  while(bits>max_bits);
+
+  memcpy(ix,q->ix,sizeof(q->ix));
   return bits;
 }
 
@@ -62,6 +154,12 @@ int shine_inner_loop(int ix[samp_per_frame2],
  *  Function: The outer iteration loop controls the masking conditions
  *  of all scalefactorbands. It computes the best scalefac and
  *  global gain. This module calls the inner iteration loop.
+ *  The bands whose noise is above their allowed distortion are amplified
+ *  (their scalefactors incremented) and the granule quantized again, up
+ *  to OUTER_MAX times (the passes of the speed level); the pass with the
+ *  fewest such bands, then the least excess noise, is kept. The bands the
+ *  second granule shares with the first (scfsi) keep the first one's
+ *  scalefactors, and the intensity stereo channel keeps its positions.
  */
 
 int shine_outer_loop( int max_bits,
@@ -69,21 +167,93 @@ int shine_outer_loop( int max_bits,
                        int ix[samp_per_frame2], /* vector of quantized values ix(0..575) */
                        int gr, int ch, shine_global_config *config)
 {
+  static int scfsi_band_long[5] = { 0, 6, 11, 16, 21 };
   int bits, huff_bits;
   shine_scalefac_t *scalefac   = &config->scalefactor;
   shine_side_info_t *side_info = &config->side_info; 
   gr_info *cod_info = &side_info->gr[gr].ch[ch].tt;
+  int *sf = scalefac->l[gr][ch];
+  int32_t xr[samp_per_frame2];
+  int best_ix[samp_per_frame2], best_sf[SFB_LMAX], over[SFB_LMAX], fixed[SFB_LMAX];
+  int i, sfb, pass, n, excess;
+  int best_pass = 0, best_n = 0, best_excess = 0, best_bits = 0;
+  int passes = speed_level[config->mpeg.speed].passes;
+  int amp = passes > 1 && !(ch==1 && (config->mpeg.mode_ext & 1));
+  gr_info best;
+
+  for(i=QUANT_CACHE; i--;)
+    config->l3loop.quant[i].step = QUANT_NONE; /* new granule */
+
+  if(amp)
+  {
+    memcpy(xr,config->l3loop.xrabs,sizeof(xr));
+    for(i=4; i--; )
+      for(sfb=scfsi_band_long[i]; sfb<scfsi_band_long[i+1]; sfb++)
+        if((fixed[sfb] = gr && side_info->scfsi[ch][i]))
+          sf[sfb] = scalefac->l[0][ch][sfb];
+    cod_info->scalefac_compress = scalefac_compress(sf);
+    amplify(xr,sf,config);
+  }
 
-  cod_info->quantizerStepSize = bin_search_StepSize(max_bits,ix,cod_info, config);
+  cod_info->quantizerStepSize = bin_search_StepSize(max_bits,cod_info,gr,ch,config);
 
   cod_info->part2_length = part2_length(scalefac,gr,ch,side_info);
   huff_bits = max_bits - cod_info->part2_length;
 
   bits = shine_inner_loop(ix, huff_bits, cod_info, gr, ch, config );
 
+  for(pass=1; amp && pass<=passes; pass++)
+  {
+    n = calc_noise(ix,cod_info,l3_xmin,sf,over,&excess,gr,ch,config);
+    if(pass==1 || n<best_n || (n==best_n && excess<best_excess))
+    {
+      best_pass = pass;
+      best_n = n;
+      best_excess = excess;
+      best_bits = bits;
+      best = *cod_info;
+      memcpy(best_sf,sf,sizeof(best_sf));
+      memcpy(best_ix,ix,sizeof(best_ix));
+    }
+    if(!n || pass==passes)
+      break;
+
+    /* amplify the bands above their allowed distortion */
+    for(i=0, sfb=0; sfb<SFB_LMAX-1; sfb++)
+      if(over[sfb] && !fixed[sfb] && sf[sfb] < (sfb<11 ? 15 : 7))
+      {
+        sf[sfb]++;
+        i++;
+      }
+    if(!i)
+      break;
+
+    cod_info->scalefac_compress = scalefac_compress(sf);
+    cod_info->part2_length = part2_length(scalefac,gr,ch,side_info);
+    amplify(xr,sf,config);
+    bits = shine_inner_loop(ix, max_bits - cod_info->part2_length, cod_info, gr, ch, config );
+  }
+
+  /* back to the best pass if the last one was not */
+  if(amp && best_pass != pass)
+  {
+    bits = best_bits;
+    *cod_info = best;
+    memcpy(sf,best_sf,sizeof(best_sf));
+    memcpy(ix,best_ix,sizeof(best_ix));
+  }
+
+  /* the region split search the inner loop left out */
+  if(speed_level[config->mpeg.speed].search == 1 && cod_info->big_values)
+    bits = count1_bitcount(ix,cod_info) + subdivide(ix,cod_info,1,config);
+
   cod_info->part2_length   = part2_length(scalefac,gr,ch,side_info);
   cod_info->part2_3_length = cod_info->part2_length + bits;
 
+  /* starting point of the next granule's step size search */
+  config->l3loop.laststep[ch] = cod_info->quantizerStepSize;
+  config->l3loop.lasten[ch]   = config->l3loop.en_tot[gr][ch];
+
   return cod_info->part2_3_length;
 }
 
@@ -95,45 +265,76 @@ void shine_iteration_loop(shine_global_config *config)
 {
   shine_psy_xmin_t l3_xmin;
   gr_info *cod_info;
-  int max_bits;
+  int max_bits, gr_bits[2];
   int ch, gr, i;
   int *ix;
+  int spare = 0;
 
   scalefac_band_long  = &shine_scale_fact_band_index[config->mpeg.samplerate_index + 3].l[0];
 
-  for(ch=config->wave.channels; ch--; )
+  memset(&config->scalefactor,0,sizeof(shine_scalefac_t));
+
+  if(config->mpeg.mode == JOINT_STEREO && config->wave.channels == 2)
+    joint_stereo(config);
+
+  if(config->mpeg.vbr)
+    vbr_bitrate(config);
+  else if(config->mpeg.abr)
+    abr_bitrate(config);
+
+  /* the reservoir lends to the granules of high perceptual entropy */
+  shine_ResvFrameBegin(config->mpeg.bits_per_frame, config);
+
+  /* granule by granule as the IS does, the perceptual entropy of both
+   * channels first so that they share the reservoir's loan to the
+   * granule; the side channel is coded first */
+  for(gr=0; gr<2; gr++)
   {
-    for(gr=0; gr<2; gr++)
+    for(ch=config->wave.channels; ch--; )
     {
-      /* setup pointers */
-      ix = config->l3_enc[gr][ch];
-      config->l3loop.xr = config->mdct_freq[gr][ch];
-
-      /* Precalculate the square, abs,  and maximum,
-       * for use later on.
-       */
-      for (i=samp_per_frame2, config->l3loop.xrmax=0; i--;)
-      {
-        config->l3loop.xrsq[i] = mulsr(config->l3loop.xr[i],config->l3loop.xr[i]);
-        config->l3loop.xrabs[i] = labs(config->l3loop.xr[i]);
-        if(config->l3loop.xrabs[i]>config->l3loop.xrmax)
-          config->l3loop.xrmax=config->l3loop.xrabs[i];
-      }
+      prepare_granule(gr,ch,config);
 
       cod_info = (gr_info *) &(config->side_info.gr[gr].ch[ch]);
       cod_info->sfb_lmax = SFB_LMAX - 1; /* gr_deco */
 
-      calc_xmin(&config->ratio, cod_info, &l3_xmin, gr, ch );
+      calc_xmin(cod_info, &l3_xmin, gr, ch, config);
 
       calc_scfsi(&l3_xmin,ch,gr,config);
 
-      /* calculation of number of available bit( per granule ) */
-      max_bits = shine_ResvMaxBits(&config->pe[gr][ch],config);
+      /* the intensity positions differ between the granules */
+      if(ch==1 && (config->mpeg.mode_ext & 1))
+        for ( i=4; i--; )
+          config->side_info.scfsi[ch][i] = 0;
+    }
 
-      /* reset of iteration variables */
-      memset(config->scalefactor.l[gr][ch],0,22);
-      memset(config->scalefactor.s[gr][ch],0,14);
+    /* calculation of number of available bit( per granule ) */
+    for(ch=config->wave.channels; ch--; )
+      gr_bits[ch] = shine_ResvMaxBits(config->pe[gr],ch,config);
 
+    for(ch=config->wave.channels; ch--; )
+    {
+      /* setup pointers */
+      ix = config->l3_enc[gr][ch];
+      cod_info = (gr_info *) &(config->side_info.gr[gr].ch[ch]);
+      /* the mono granule is still prepared */
+      if(config->wave.channels == 2)
+        prepare_granule(gr,ch,config);
+
+      max_bits = gr_bits[ch];
+
+      /* the bits the side or intensity channel (coded first) leaves go
+       * to the other one */
+      if(ch==0 && config->mpeg.mode_ext)
+      {
+        max_bits += spare;
+        if(max_bits>4095)
+          max_bits = 4095;
+        /* the spare bits are back in the reservoir already */
+        if(config->ResvMax && max_bits > config->mean_bits/2 + config->ResvSize)
+          max_bits = config->mean_bits/2 + config->ResvSize;
+      }
+
+      /* reset of iteration variables */
       for ( i=4; i--; )
         cod_info->slen[i] = 0;
 
@@ -151,24 +352,349 @@ void shine_iteration_loop(shine_global_config *config)
       cod_info->scalefac_scale    = 0;
       cod_info->count1table_select= 0;
 
+      if(ch==1 && (config->mpeg.mode_ext & 1))
+        cod_info->scalefac_compress = scalefac_compress(config->scalefactor.l[gr][ch]);
+
       /* all spectral values zero ? */
       if(config->l3loop.xrmax)
         cod_info->part2_3_length = shine_outer_loop(max_bits,&l3_xmin,ix,
                                               gr,ch,config);
 
+      if(ch==1 && (config->mpeg.mode_ext & 1))
+        cod_info->part2_3_length = intensity_bound(max_bits,ix,cod_info,gr,config);
+
+      spare = max_bits - cod_info->part2_3_length;
       shine_ResvAdjust(cod_info, config );
-      cod_info->global_gain = cod_info->quantizerStepSize+210;
+      /* 210, plus 4 for the guard bit of the MDCT output, see mdct_long,
+       * and 4 for each of the joint stereo ones, see joint_stereo */
+      cod_info->global_gain = cod_info->quantizerStepSize+214+4*config->l3loop.js_shift[gr];
 
-    } /* for gr */
-  } /* for ch */
+    } /* for ch */
+  } /* for gr */
 
   shine_ResvFrameEnd(config);
 }
 
+/*
+ * prepare_granule:
+ * ----------------
+ * Points xr at the granule and precalculates the square, abs, and
+ * maximum, for use later on. The lines above the bandwidth of the speed
+ * level are left out (zero).
+ */
+static void prepare_granule(int gr, int ch, shine_global_config *config)
+{
+  long bw = speed_level[config->mpeg.speed].bandwidth;
+  int i, n = samp_per_frame2;
+
+  if(bw && bw*samp_per_frame/config->wave.samplerate < n)
+    n = bw*samp_per_frame/config->wave.samplerate;
+  for (i=samp_per_frame2; i-- > n;)
+    config->l3loop.xrsq[i] = config->l3loop.xrabs[i] = 0;
+
+  config->l3loop.xr = config->mdct_freq[gr][ch];
+  for (i=n, config->l3loop.xrmax=0; i--;)
+  {
+    config->l3loop.xrsq[i] = mulsr(config->l3loop.xr[i],config->l3loop.xr[i]);
+    config->l3loop.xrabs[i] = abs(config->l3loop.xr[i]);
+    if(config->l3loop.xrabs[i]>config->l3loop.xrmax)
+      config->l3loop.xrmax=config->l3loop.xrabs[i];
+  }
+}
+
+/*
+ * frame_need:
+ * -----------
+ * The bits the granules of the frame take when quantized with the step
+ * size #offset# (1.5dB units) relative to their peaks, so that the
+ * quantized peaks keep the same resolution.
+ */
+static int frame_need(int offset, shine_global_config *config)
+{
+  gr_info cod_info;
+  quant_t *q;
+  int gr, ch, i, bits, step;
+  int need = 0;
+
+  for(ch=config->wave.channels; ch--; )
+    for(gr=0; gr<2; gr++)
+    {
+      prepare_granule(gr,ch,config);
+      if(!config->l3loop.xrmax)
+        continue;
+
+      for(i=QUANT_CACHE; i--;)
+        config->l3loop.quant[i].step = QUANT_NONE;
+      step = (int)(4 * log(config->l3loop.xrmax / 2147483648.0) / LN2) + offset;
+      for(step=MAX(step,-124); (q = quantize(step,config))->max > 8192; step++)
+        ;
+      memset(&cod_info,0,sizeof(gr_info));
+      calc_runlen(q->ix,&cod_info);
+      bits = count1_bitcount(q->ix,&cod_info) + subdivide(q->ix,&cod_info,0,config);
+
+      /* the intensity positions */
+      if(ch==1 && (config->mpeg.mode_ext & 1))
+      {
+        i = scalefac_compress(config->scalefactor.l[gr][ch]);
+        bits += 11*slen1_tab[i] + 10*slen2_tab[i];
+      }
+      need += MIN(bits, 4095);
+    }
+  return need;
+}
+
+/* The bits of a frame at bitrate_index #i# */
+#define frame_bits(i,config) (samp_per_frame*bitrates[(i)-1]*125/(config)->wave.samplerate*8)
+
+/* Sets the bitrate of the frame */
+static void set_bitrate(int i, shine_global_config *config)
+{
+  config->mpeg.bitrate_index  = i;
+  config->mpeg.bitr           = bitrates[i-1];
+  config->mpeg.bits_per_frame = frame_bits(i,config);
+  config->mean_bits = (config->mpeg.bits_per_frame - config->sideinfo_len)>>1;
+}
+
+/*
+ * vbr_bitrate:
+ * ------------
+ * Chooses the bitrate of the frame in VBR mode: the smallest one whose
+ * frame holds the granules quantized with the step size of the quality
+ * target, VBR_STEP + 2 (3dB) per quality level relative to their peaks.
+ * The rate loop then finds the step sizes within that budget, at or
+ * below the target unless the largest frame is too small. At 44.1kHz,
+ * quality 5 is about 128 kbps on dense music and less on simpler or
+ * quieter material.
+ */
+static void vbr_bitrate(shine_global_config *config)
+{
+  int i, need = frame_need(VBR_STEP + 2*config->mpeg.vbr, config);
+
+  for(i=1; i<14; i++)
+    if(frame_bits(i,config) - config->sideinfo_len >= need)
+      break;
+  set_bitrate(i,config);
+}
+
+/*
+ * abr_bitrate:
+ * ------------
+ * Chooses the bitrate of the frame in ABR mode, so that the frames of
+ * the last mpeg.abr average to the bitrate of the stream.
+ * The bits the frame takes at the quality target of VBR quality 5
+ * measure how hard it is, the frame gets its share of the mean in
+ * proportion to that over the window, less the bits the window has
+ * spent over the mean spread over its length. The nearest bitrate is
+ * used, and the reservoir evens out the rest between the frames.
+ */
+static void abr_bitrate(shine_global_config *config)
+{
+  abr_t *abr = &config->abr;
+  int window = config->mpeg.abr;
+  int64_t target = (int64_t)samp_per_frame*abr->bitr*1000/config->wave.samplerate;
+  int64_t want;
+  int i, need = frame_need(VBR_STEP + 10, config) + config->sideinfo_len;
+
+  /* the window's oldest frame drops out with this one */
+  if(abr->n == window)
+  {
+    abr->sum -= abr->bits[abr->head];
+    abr->need_sum -= abr->need[abr->head];
+    abr->n--;
+  }
+
+  want = target;
+  if(abr->need_sum)
+    want = need * target * (abr->n + 1) / (abr->need_sum + need);
+  want -= (abr->sum - target*abr->n) / window;
+
+  for(i=1; i<14 && frame_bits(i,config) < want; i++)
+    ;
+  if(i>1 && want - frame_bits(i-1,config) < frame_bits(i,config) - want)
+    i--;
+  set_bitrate(i,config);
+
+  abr->sum += abr->bits[abr->head] = config->mpeg.bits_per_frame;
+  abr->need_sum += abr->need[abr->head] = need;
+  abr->head = (abr->head + 1) % window;
+  abr->n++;
+}
+
+/*
+ * joint_stereo:
+ * -------------
+ * Chooses the joint stereo coding of the frame (mode_ext) and converts
+ * mdct_freq accordingly.
+ * At IS_MAX_BITR kbps and below, the bands from about IS_HZ_PER_KBPS
+ * times the bitrate up are intensity coded.  That is the nominal bitrate
+ * of the stream (abr.bitr): in VBR and ABR the bitrate of the frame is
+ * only chosen afterwards, from the bits of the coding chosen here, and
+ * mpeg.bitr still holds the previous frame's.  The left channel carries
+ * X = s(L+R), with s keeping the energy of both channels, the right one
+ * is zero and its scalefactors hold the position is_pos, L/R being
+ * tan(is_pos*PI/12), from which the decoder rebuilds both channels.
+ * The other bands are coded as mid and side, M = (L+R)/sqrt(2) and
+ * S = (L-R)/sqrt(2), when that lowers the sum over the bands, weighted by
+ * their width, of log(Em*Es) - log(El*Er): the bits of a band grow with
+ * the log of its energy per line, and M/S wins when the channels are
+ * correlated.
+ */
+static void joint_stereo(shine_global_config *config)
+{
+  int32_t *xl, *xr, s[21];
+  int64_t el, er, em, es, l, r, max;
+  double cost = 0;
+  int gr, b, i, end, pos, is_line, k;
+  int is_sfb = 21;
+
+  if(config->abr.bitr <= IS_MAX_BITR)
+  {
+    is_line = config->abr.bitr * IS_HZ_PER_KBPS * 1152L / config->wave.samplerate;
+    for(is_sfb=0; is_sfb<20 && scalefac_band_long[is_sfb]<is_line; is_sfb++)
+      ;
+  }
+  config->l3loop.is_sfb = is_sfb;
+  is_line = is_sfb<21 ? scalefac_band_long[is_sfb] : samp_per_frame2;
+
+  for(gr=0; gr<2; gr++)
+  {
+    xl = config->mdct_freq[gr][0];
+    xr = config->mdct_freq[gr][1];
+    for(b=0; b<SFB_LMAX && scalefac_band_long[b]<is_line; b++)
+    {
+      el = er = em = es = 0;
+      for(i=scalefac_band_long[b]; i<scalefac_band_long[b+1]; i++)
+      {
+        l = xl[i] >> 8;
+        r = xr[i] >> 8;
+        el += l*l;
+        er += r*r;
+        em += ((l+r)*(l+r)) >> 1;
+        es += ((l-r)*(l-r)) >> 1;
+      }
+      cost += (scalefac_band_long[b+1] - scalefac_band_long[b]) *
+              log(((em+1.0)*(es+1.0)) / ((el+1.0)*(er+1.0)));
+    }
+  }
+
+  config->mpeg.mode_ext = (cost < 0 ? 2 : 0) | (is_sfb < 21);
+
+  for(gr=0; gr<2; gr++)
+  {
+    xl = config->mdct_freq[gr][0];
+    xr = config->mdct_freq[gr][1];
+
+    /* band 20 extends to the top, the decoder uses its is_pos for band 21 */
+    for(b=is_sfb; b<21; b++)
+    {
+      end = b<20 ? scalefac_band_long[b+1] : samp_per_frame2;
+      el = er = em = 0;
+      for(i=scalefac_band_long[b]; i<end; i++)
+      {
+        l = xl[i] >> 8;
+        r = xr[i] >> 8;
+        el += l*l;
+        er += r*r;
+        em += (l+r)*(l+r);
+      }
+      pos = er ? (int)(atan(sqrt((double)el/er)) * 12/PI + 0.5) : 6;
+      config->scalefactor.l[gr][1][b] = pos;
+
+      /* E(X) = (El+Er)(1+k)^2/(1+k^2) = (El+Er)(1+sin(2*is_pos*PI/12)),
+       * s in Q29 is at most 2, when the channels are out of phase */
+      s[b] = em ? (int32_t)(MIN(sqrt((el+er) * (1+sin(pos*PI/6)) / em), 2.0) * (1<<29)) : 0;
+    }
+
+    /* M and S reach sqrt(2) times the largest line and X = s*(L+R) four
+     * times, the granule is shifted down by the guard bits they need
+     * (global_gain compensates) */
+    max = 0;
+    if(config->mpeg.mode_ext & 2)
+      for(i=0; i<is_line; i++)
+      {
+        l = ((int64_t)xl[i] + xr[i]) * 0x5a82799a >> 31;
+        r = ((int64_t)xl[i] - xr[i]) * 0x5a82799a >> 31;
+        max = MAX(max, MAX(llabs(l), llabs(r)));
+      }
+    for(b=is_sfb; b<21; b++)
+    {
+      end = b<20 ? scalefac_band_long[b+1] : samp_per_frame2;
+      for(i=scalefac_band_long[b]; i<end; i++)
+        max = MAX(max, llabs(((int64_t)xl[i] + xr[i]) * s[b] >> 29));
+    }
+    for(k=0; (max >> k) > INT32_MAX; k++)
+      ;
+    config->l3loop.js_shift[gr] = k;
+
+    for(b=is_sfb; b<21; b++)
+    {
+      end = b<20 ? scalefac_band_long[b+1] : samp_per_frame2;
+      for(i=scalefac_band_long[b]; i<end; i++)
+      {
+        xl[i] = sat32(((int64_t)xl[i] + xr[i]) * s[b] >> (29 + k));
+        xr[i] = 0;
+      }
+    }
+
+    if(config->mpeg.mode_ext & 2)
+      for(i=0; i<is_line; i++)
+      {
+        /* 1/sqrt(2) in Q31 */
+        l = ((int64_t)xl[i] + xr[i]) * 0x5a82799a >> 31;
+        r = ((int64_t)xl[i] - xr[i]) * 0x5a82799a >> 31;
+        xl[i] = sat32(l >> k);
+        xr[i] = sat32(r >> k);
+      }
+    else if(k)
+      for(i=0; i<is_line; i++)
+      {
+        xl[i] >>= k;
+        xr[i] >>= k;
+      }
+  }
+}
+
+/*
+ * intensity_bound:
+ * ----------------
+ * The decoder intensity codes the bands above the last non zero value of
+ * the right channel, so the bands the quantization zeroed below is_sfb
+ * get the illegal position 7, which decodes them as left/right or
+ * mid/side. Their scalefactors may need more bits, the granule is then
+ * quantized again more coarsely. Returns part2_3_length.
+ */
+static int intensity_bound(int max_bits, int ix[samp_per_frame2], gr_info *cod_info,
+                           int gr, shine_global_config *config)
+{
+  int *sf = config->scalefactor.l[gr][1];
+  int bits = cod_info->part2_3_length - cod_info->part2_length;
+  int i, sfb;
+
+  for(;;)
+  {
+    for(i=(cod_info->big_values<<1) + (cod_info->count1<<2); i && !ix[i-1]; i--)
+      ;
+    for(sfb=0; scalefac_band_long[sfb]<i; sfb++)
+      ;
+    for(; sfb<config->l3loop.is_sfb; sfb++)
+      sf[sfb] = 7;
+
+    cod_info->scalefac_compress = scalefac_compress(sf);
+    cod_info->part2_length = part2_length(&config->scalefactor,gr,1,&config->side_info);
+    if(cod_info->part2_length + bits <= max_bits || !config->l3loop.xrmax)
+      return cod_info->part2_length + bits;
+
+    cod_info->quantizerStepSize++;
+    bits = shine_inner_loop(ix, max_bits - cod_info->part2_length, cod_info, gr, 1, config);
+  }
+}
+
 /*
  * calc_scfsi:
  * -----------
  * calculation of the scalefactor select information ( scfsi ).
+ * The speed levels without scfsi only compute the band energies, which
+ * the perceptual entropy needs.
  */
 void calc_scfsi( shine_psy_xmin_t *l3_xmin, int ch, int gr,
                  shine_global_config *config )
@@ -187,7 +713,8 @@ void calc_scfsi( shine_psy_xmin_t *l3_xmin, int ch, int gr,
 
   int sfb, start, end, i;
   int condition = 0;
-  long temp;
+  long temp, noise, pe;
+  int scfsi = speed_level[config->mpeg.speed].scfsi;
   /* gr_info *cod_info = &l3_side->gr[gr].ch[ch].tt; */ /* Unused */
 
 /*
@@ -199,16 +726,21 @@ void calc_scfsi( shine_psy_xmin_t *l3_xmin, int ch, int gr,
       return;
 */
 
-  config->l3loop.xrmaxl[gr] = config->l3loop.xrmax;
+  config->l3loop.xrmaxl[gr][ch] = config->l3loop.xrmax;
   scfsi_set = 0;
 
   /* the total energy of the granule */
   for ( temp = 0, i =samp_per_frame2; i--;  )
     temp += config->l3loop.xrsq[i]>>10; /* a bit of scaling to avoid overflow, (not very good) */
   if ( temp )
-    config->l3loop.en_tot[gr] = log((double)temp * 4.768371584e-7) / LN2; /* 1024 / 0x7fffffff */
+    config->l3loop.en_tot[gr][ch] = log((double)temp * 4.768371584e-7) / LN2; /* 1024 / 0x7fffffff */
   else
-    config->l3loop.en_tot[gr] = 0;
+    config->l3loop.en_tot[gr][ch] = 0;
+
+  /* the noise allowed per line, PE_SMR below the mean energy per line
+   * (the granule has about 2^9 lines) */
+  noise = config->l3loop.en_tot[gr][ch] - 9 - PE_SMR;
+  pe = 0;
 
   /* the energy of each scalefactor band, en */
   /* the allowed distortion of each scalefactor band, xm */
@@ -221,15 +753,23 @@ void calc_scfsi( shine_psy_xmin_t *l3_xmin, int ch, int gr,
     for ( temp = 0, i = start; i < end; i++ )
       temp += config->l3loop.xrsq[i]>>10;
     if ( temp )
-      config->l3loop.en[gr][sfb] = log((double)temp * 4.768371584e-7) / LN2; /* 1024 / 0x7fffffff */
+      config->l3loop.en[gr][ch][sfb] = log((double)temp * 4.768371584e-7) / LN2; /* 1024 / 0x7fffffff */
     else
-      config->l3loop.en[gr][sfb] = 0;
+      config->l3loop.en[gr][ch][sfb] = 0;
 
-    if ( l3_xmin->l[gr][ch][sfb])
-      config->l3loop.xm[gr][sfb] = log( l3_xmin->l[gr][ch][sfb] ) / LN2;
+    if ( l3_xmin->l[gr][ch][sfb] && scfsi )
+      config->l3loop.xm[gr][ch][sfb] = log( l3_xmin->l[gr][ch][sfb] ) / LN2;
     else
-      config->l3loop.xm[gr][sfb] = 0;
+      config->l3loop.xm[gr][ch][sfb] = 0;
+
+    /* the bits of the band: half a bit per line for each doubling of its
+     * energy per line over the allowed noise */
+    for ( i = 0; (2 << i) <= end - start; i++ )
+      ;
+    if ( temp && (i = config->l3loop.en[gr][ch][sfb] - i - noise) > 0 )
+      pe += (end - start) * i;
   }
+  config->pe[gr][ch] = pe >> 1;
 
   if(gr==1)
   {
@@ -238,19 +778,19 @@ void calc_scfsi( shine_psy_xmin_t *l3_xmin, int ch, int gr,
     for(gr2=2; gr2--; )
     {
       /* The spectral values are not all zero */
-      if(config->l3loop.xrmaxl[gr2])
+      if(config->l3loop.xrmaxl[gr2][ch])
         condition++;
 
       condition++;
     }
-    if(abs(config->l3loop.en_tot[0]-config->l3loop.en_tot[1]) < en_tot_krit)
+    if(abs(config->l3loop.en_tot[0][ch]-config->l3loop.en_tot[1][ch]) < en_tot_krit)
       condition++;
     for(tp=0,sfb=21; sfb--; )
-      tp += abs(config->l3loop.en[0][sfb]-config->l3loop.en[1][sfb]);
+      tp += abs(config->l3loop.en[0][ch][sfb]-config->l3loop.en[1][ch][sfb]);
     if (tp < en_dif_krit)
       condition++;
 
-    if(condition==6)
+    if(condition==6 && scfsi)
     {
       for(scfsi_band=0;scfsi_band<4;scfsi_band++)
       {
@@ -260,8 +800,8 @@ void calc_scfsi( shine_psy_xmin_t *l3_xmin, int ch, int gr,
         end   = scfsi_band_long[scfsi_band+1];
         for ( sfb = start; sfb < end; sfb++ )
         {
-          sum0 += abs( config->l3loop.en[0][sfb] - config->l3loop.en[1][sfb] );
-          sum1 += abs( config->l3loop.xm[0][sfb] - config->l3loop.xm[1][sfb] );
+          sum0 += abs( config->l3loop.en[0][ch][sfb] - config->l3loop.en[1][ch][sfb] );
+          sum1 += abs( config->l3loop.xm[0][ch][sfb] - config->l3loop.xm[1][ch][sfb] );
         }
 
         if(sum0<en_scfsi_band_krit && sum1<xm_scfsi_band_krit)
@@ -280,10 +820,6 @@ void calc_scfsi( shine_psy_xmin_t *l3_xmin, int ch, int gr,
 
 }
 
-/* these used in next two functions */
-static int slen1_tab[16] = { 0, 0, 0, 0, 3, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4 };
-static int slen2_tab[16] = { 0, 1, 2, 3, 0, 1, 2, 3, 1, 2, 3, 1, 2, 3, 2, 3 };
-
 /*
  * part2_length:
  * -------------
@@ -318,48 +854,152 @@ int part2_length(shine_scalefac_t *scalefac,
   return bits;
 }
 
+/*
+ * scalefac_compress:
+ * ------------------
+ * The scalefac_compress whose slen1 (bands 0..10) and slen2 (11..20)
+ * hold the scalefactors #sf# in the fewest bits.
+ */
+static int scalefac_compress(int sf[])
+{
+  int i, sfb, max1 = 0, max2 = 0, best = 15;
+
+  for(sfb=0; sfb<11; sfb++)
+    max1 = MAX(max1, sf[sfb]);
+  for(; sfb<21; sfb++)
+    max2 = MAX(max2, sf[sfb]);
+
+  for(i=16; i--; )
+    if((1<<slen1_tab[i]) > max1 && (1<<slen2_tab[i]) > max2 &&
+       11*slen1_tab[i] + 10*slen2_tab[i] <= 11*slen1_tab[best] + 10*slen2_tab[best])
+      best = i;
+  return best;
+}
+
 /*
  * calc_xmin:
  * ----------
- * Calculate the allowed distortion for each scalefactor band,
- * as determined by the psychoacoustic model.
- * xmin(sb) = ratio(sb) * en(sb) / bw(sb)
+ * Calculate the allowed distortion for each scalefactor band, as
+ * determined by a masking model in integer arithmetic: the energy per
+ * line of every band masks noise MASK_SMR below it in its own band,
+ * spreading to the bands above and below it with the slopes MASK_UP and
+ * MASK_DOWN. The highest of these thresholds, times the band width, is
+ * the band's allowed distortion, in the units of xrsq and at least one
+ * per line (about the level of 16 bit quantization).
  */
-void calc_xmin(shine_psy_ratio_t *ratio,
-               gr_info *cod_info,
+void calc_xmin(gr_info *cod_info,
                shine_psy_xmin_t *l3_xmin,
-               int gr, int ch )
+               int gr, int ch,
+               shine_global_config *config)
 {
-  int sfb;
+  int64_t en[SFB_LMAX], thr, t;
+  int sfb, j, l, start, end, shift;
 
   for ( sfb = cod_info->sfb_lmax; sfb--; )
   {
-/*  note. xmin will always be zero with no psychoacoustic model
-
     start = scalefac_band_long[ sfb ];
     end   = scalefac_band_long[ sfb+1 ];
-    bw = end - start;
 
-    for ( en = 0, l = start; l < end; l++ )
-      en += config->l3loop.xrsq[l];
+    for ( en[sfb] = 0, l = start; l < end; l++ )
+      en[sfb] += config->l3loop.xrsq[l];
+    en[sfb] /= end - start;
+  }
 
-    l3_xmin->l[gr][ch][sfb] = ratio->l[gr][ch][sfb] * en / bw;
-*/
-    l3_xmin->l[gr][ch][sfb] = 0;
+  for ( sfb = cod_info->sfb_lmax; sfb--; )
+  {
+    for ( thr = 1, j = cod_info->sfb_lmax; j--; )
+    {
+      shift = MASK_SMR + (j < sfb ? MASK_UP*(sfb-j) : MASK_DOWN*(j-sfb));
+      if ( shift < 63 && (t = en[j] >> shift) > thr )
+        thr = t;
+    }
+    l3_xmin->l[gr][ch][sfb] = (double)(thr * (scalefac_band_long[sfb+1] - scalefac_band_long[sfb]));
   }
 }
 
+/*
+ * amplify:
+ * --------
+ * Sets xrabs to the magnitudes #xr# of the granule with each band scaled
+ * by 2**(sf/2), what the quantizer has to see for the decoder to divide
+ * them by the band's scalefactor, and drops the cached quantizations.
+ */
+static void amplify(int32_t xr[samp_per_frame2], int sf[], shine_global_config *config)
+{
+  l3loop_t *l3loop = &config->l3loop;
+  int sfb, i, end;
+  int64_t x;
+
+  for ( sfb = 0; sfb < SFB_LMAX-1; sfb++ )
+  {
+    end = scalefac_band_long[ sfb+1 ];
+    for ( i = scalefac_band_long[ sfb ]; i < end; i++ )
+    {
+      x = ((int64_t)xr[i] * l3loop->ampl[sf[sfb]]) >> 23;
+      l3loop->xrabs[i] = x > 0x7fffffff ? 0x7fffffff : (int32_t)x;
+    }
+  }
+
+  for(i=QUANT_CACHE; i--;)
+    l3loop->quant[i].step = QUANT_NONE;
+}
+
+/*
+ * calc_noise:
+ * -----------
+ * Compares the quantization noise of each band of #ix# with its allowed
+ * distortion, amplified like the band. Marks the bands above it in
+ * #over#, returns their number and sets #excess# to the sum of their
+ * noise to allowed distortion ratios (Q8, at most 256 each).
+ * The spectral values are dequantized in integer arithmetic, from the
+ * x**(4/3) table and the powers of 2**(1/4) of the step size.
+ */
+static int calc_noise(int ix[samp_per_frame2], gr_info *cod_info, shine_psy_xmin_t *l3_xmin,
+                      int sf[], int over[], int *excess, int gr, int ch, shine_global_config *config)
+{
+  l3loop_t *l3loop = &config->l3loop;
+  int step = cod_info->quantizerStepSize;
+  int64_t f = l3loop->fourth[step & 3];
+  int shift = 11 - (step >> 2); /* Q12 * Q30, to the Q31 of xrabs */
+  int sfb, i, end, n = 0;
+  int64_t noise, d, xmin;
+
+  *excess = 0;
+  for ( sfb = 0; sfb < SFB_LMAX-1; sfb++ )
+  {
+    end = scalefac_band_long[ sfb+1 ];
+    for ( noise = 0, i = scalefac_band_long[ sfb ]; i < end; i++ )
+    {
+      d = l3loop->xrabs[i] - ((l3loop->pow43[ix[i]] * f) >> shift);
+      noise += (d * d) >> 31;
+    }
+
+    xmin = (int64_t)l3_xmin->l[gr][ch][sfb] << sf[sfb];
+    if ( (over[sfb] = noise > xmin) )
+    {
+      n++;
+      *excess += noise >= xmin*256 ? 256*256 : (int)((noise << 8) / xmin);
+    }
+  }
+  return n;
+}
+
 /*
  * shine_loop_initialise:
  * -------------------
- * Calculates the look up tables used by the iteration loop.
+ * Calculates the look up tables used by the iteration loop, and chooses
+ * the quantizer kernel for the cpu.
  */
 void shine_loop_initialise(shine_global_config *config)
 {
-  int i;
+  struct huffcodetab *h;
+  int i, k, x, y;
 
   config->side_info.main_data_begin = 0;
 
+  for(i=MAX_CHANNELS; i--;)
+    config->l3loop.laststep[i] = 1; /* no previous granule */
+
   /* quantize: stepsize conversion, fourth root of 2 table.
    * The table is inverted (negative power) from the equation given
    * in the spec because it is quicker to do x*y than x/y.
@@ -368,80 +1008,149 @@ void shine_loop_initialise(shine_global_config *config)
   for(i=128; i--;)
   {
     config->l3loop.steptab[i] = pow(2.0,(double)(127-i)/4);
-    if((config->l3loop.steptab[i]*2)>0x7fffffff) /* MAXINT = 2**31 = 2**(124/4) */
-      config->l3loop.steptabi[i]=0x7fffffff;
+    if((config->l3loop.steptab[i]*2)>0xffffffff) /* 2**32 = 2**(128/4) */
+      config->l3loop.steptabi[i]=0xffffffff;
     else
       /* The table is multiplied by 2 to give an extra bit of accuracy.
        * In quantize, the long multiply does not shift it's result left one
        * bit to compensate.
        */
-      config->l3loop.steptabi[i] = (long)((config->l3loop.steptab[i]*2) + 0.5);
+      config->l3loop.steptabi[i] = (uint32_t)((config->l3loop.steptab[i]*2) + 0.5);
   }
 
   /* quantize: vector conversion, three quarter power table.
    * The 0.5 is for rounding, the .0946 comes from the spec.
    */
   for(i=10000; i--;)
-    config->l3loop.int2idx[i] = (long)(sqrt(sqrt((double)i)*(double)i) - 0.0946 + 0.5);
+    config->l3loop.int2idx[i] = (int32_t)(sqrt(sqrt((double)i)*(double)i) - 0.0946 + 0.5);
+
+  /* calc_noise: the dequantization tables */
+  for(i=8193; i--;)
+    config->l3loop.pow43[i] = (int32_t)(pow((double)i, 4.0/3.0) * 4096 + 0.5);
+  for(i=4; i--;)
+    config->l3loop.fourth[i] = (int32_t)(pow(2.0, i/4.0) * (1<<30) + 0.5);
+
+  /* amplify: the scalefactor gains, sqrt(2) per step */
+  for(i=16; i--;)
+    config->l3loop.ampl[i] = (int32_t)(pow(2.0, i/2.0) * (1<<23) + 0.5);
+
+  /* subdivide: code lengths plus sign bits of the pair (x,y) for each
+   * table of htable, packed in 16 bit fields, zero where the pair does not
+   * fit the table.  Values above 15 use the entries of 15, the escape
+   * field counts them (the linbits are added later).
+   */
+  for(i=256; i--; )
+  {
+    x = i>>4;
+    y = i&15;
+    for(k=4; k--; )
+      config->l3loop.hcost[i][k] = 0;
+    for(k=HFIELD_ESC; k--; )
+    {
+      h = &shine_huffman_table[htable[k]];
+      if(x<h->xlen && y<h->xlen)
+        config->l3loop.hcost[i][k>>2] |=
+          (uint64_t)(h->hlen[x*h->ylen+y] + (x!=0) + (y!=0)) << ((k&3)<<4);
+    }
+    config->l3loop.hcost[i][HFIELD_ESC>>2] |=
+      (uint64_t)((x==15) + (y==15)) << ((HFIELD_ESC&3)<<4);
+  }
+
+  config->l3loop.quantize = shine_quantize_c;
+#ifdef SHINE_X86
+  if (shine_cpu_features() & SHINE_CPU_AVX2)
+    config->l3loop.quantize = shine_quantize_avx2;
+#endif
 }
 
 /*
  * quantize:
  * ---------
  * Function: Quantization of the vector xr ( -> ix).
- * Returns maximum value of ix.
+ * Returns the quantization at #stepsize#, whose max is the maximum
+ * value of ix.
+ * The last QUANT_CACHE quantizations of the granule are kept, so the step
+ * sizes the rate loops come back to cost nothing.  A larger step size
+ * can only lower the quantized values, so the values after the end of a
+ * counted smaller step size stay zero and only the ones before it are
+ * quantized.
  */
-int quantize(int ix[samp_per_frame2], int stepsize, shine_global_config *config )
+quant_t *quantize(int stepsize, shine_global_config *config )
 {
-  int i, max, ln, scalei;
-  double scale, dbl;
+  l3loop_t *l3loop = &config->l3loop;
+  quant_t *q;
+  int i, n;
+  uint32_t scalei;
+
+  for(i=QUANT_CACHE; i--;)
+    if(l3loop->quant[i].step == stepsize)
+      return &l3loop->quant[i];
 
-  scalei = config->l3loop.steptabi[stepsize+127]; /* 2**(-stepsize/4) */
+  q = &l3loop->quant[l3loop->quantnext];
+  l3loop->quantnext = (l3loop->quantnext + 1) % QUANT_CACHE;
+  q->step = stepsize;
+  q->bits = -1;
+
+  scalei = l3loop->steptabi[stepsize+127]; /* 2**(-stepsize/4) */
 
   /* a quick check to see if ixmax will be less than 8192 */
   /* this speeds up the early calls to bin_search_StepSize */
-  if((mulr(config->l3loop.xrmax,scalei)) > 165140) /* 8192**(4/3) */
-    max = 16384; /* no point in continuing, stepsize not big enough */
-  else
-    for(i=0, max=0;i<samp_per_frame2;i++)
-    {
-      /* This calculation is very sensitive. The multiply must round it's
-       * result or bad things happen to the quality.
-       */
-      ln = mulr(labs(config->l3loop.xr[i]),scalei);
-
-      if(ln<10000) /* ln < 10000 catches most values */
-        ix[i] = config->l3loop.int2idx[ln]; /* quick look up method */
-      else
-      {
-        /* outside table range so have to do it using floats */
-        scale = config->l3loop.steptab[stepsize+127]; /* 2**(-stepsize/4) */
-        dbl = ((double)config->l3loop.xrabs[i]) * scale * 4.656612875e-10; /* 0x7fffffff */
-        ix[i] = (int)sqrt(sqrt(dbl)*dbl); /* dbl**(3/4) */
-      }
+  if((mulr(l3loop->xrmax,scalei)) > 165140) /* 8192**(4/3) */
+  {
+    q->max = 16384; /* no point in continuing, stepsize not big enough */
+    return q;
+  }
 
-      /* calculate ixmax while we're here */
-      /* note. ix cannot be negative */
-      if(max < ix[i])
-        max = ix[i];
-    }
+  for(i=QUANT_CACHE, n=samp_per_frame2; i--;)
+    if(l3loop->quant[i].step < stepsize && l3loop->quant[i].bits >= 0 &&
+       l3loop->quant[i].end < n)
+      n = l3loop->quant[i].end;
+  n = (n + 7) & ~7; /* whole vectors for the kernels */
 
-  return max;
- }
+  q->max = l3loop->quantize(q->ix,stepsize,n,l3loop);
+  for(i=n; i<samp_per_frame2; i++)
+    q->ix[i] = 0;
+  return q;
+}
 
 /*
- * ix_max:
- * -------
- * Function: Calculate the maximum of ix from 0 to 575
+ * shine_quantize_c:
+ * -----------------
+ * Reference quantizer kernel, ix = (xrabs * 2**(-stepsize/4))**(3/4)
+ * for the first #n# values, with the maximum of ix computed in the same
+ * pass.
  */
-int ix_max( int ix[samp_per_frame2], unsigned int begin, unsigned int end )
+int shine_quantize_c(int ix[samp_per_frame2], int stepsize, int n, l3loop_t *l3loop)
 {
-  register int i;
-  register int max = 0;
+  int i, max, ln;
+  uint32_t scalei;
+  double scale, dbl;
+
+  scalei = l3loop->steptabi[stepsize+127]; /* 2**(-stepsize/4) */
 
-  for(i=begin;i<end;i++)
+  for(i=0, max=0;i<n;i++)
+  {
+    /* This calculation is very sensitive. The multiply must round it's
+     * result or bad things happen to the quality.
+     */
+    ln = mulr(l3loop->xrabs[i],scalei);
+
+    if(ln<10000) /* ln < 10000 catches most values */
+      ix[i] = l3loop->int2idx[ln]; /* quick look up method */
+    else
+    {
+      /* outside table range so have to do it using floats */
+      scale = l3loop->steptab[stepsize+127]; /* 2**(-stepsize/4) */
+      dbl = ((double)l3loop->xrabs[i]) * scale * 4.656612875e-10; /* 0x7fffffff */
+      ix[i] = (int)sqrt(sqrt(dbl)*dbl); /* dbl**(3/4) */
+    }
+
+    /* calculate ixmax while we're here */
+    /* note. ix cannot be negative */
     if(max < ix[i])
       max = ix[i];
+  }
+
   return max;
 }
 
@@ -522,187 +1231,42 @@ int count1_bitcount(int ix[samp_per_frame2], gr_info *cod_info)
 }
 
 /*
- * subdivide:
- * ----------
- * presumable subdivides the bigvalue region which will use separate Huffman tables.
- */
-void subdivide(gr_info *cod_info)
-{
-  static struct
-  {
-    unsigned region0_count;
-    unsigned region1_count;
-  } subdv_table[ 23 ] =
-  {
-    {0, 0}, /* 0 bands */
-    {0, 0}, /* 1 bands */
-    {0, 0}, /* 2 bands */
-    {0, 0}, /* 3 bands */
-    {0, 0}, /* 4 bands */
-    {0, 1}, /* 5 bands */
-    {1, 1}, /* 6 bands */
-    {1, 1}, /* 7 bands */
-    {1, 2}, /* 8 bands */
-    {2, 2}, /* 9 bands */
-    {2, 3}, /* 10 bands */
-    {2, 3}, /* 11 bands */
-    {3, 4}, /* 12 bands */
-    {3, 4}, /* 13 bands */
-    {3, 4}, /* 14 bands */
-    {4, 5}, /* 15 bands */
-    {4, 5}, /* 16 bands */
-    {4, 6}, /* 17 bands */
-    {5, 6}, /* 18 bands */
-    {5, 6}, /* 19 bands */
-    {5, 7}, /* 20 bands */
-    {6, 7}, /* 21 bands */
-    {6, 7}, /* 22 bands */
-  };
-
-  int scfb_anz = 0;
-  int bigvalues_region;
-
-  if ( !cod_info->big_values)
-  { /* no big_values region */
-    cod_info->region0_count = 0;
-    cod_info->region1_count = 0;
-  }
-  else
-  {
-    bigvalues_region = 2 * cod_info->big_values;
-    {
-      int thiscount, index;
-      /* Calculate scfb_anz */
-      while ( scalefac_band_long[scfb_anz] < bigvalues_region )
-        scfb_anz++;
-
-      cod_info->region0_count = subdv_table[scfb_anz].region0_count;
-      thiscount = cod_info->region0_count;
-      index = thiscount + 1;
-      while ( thiscount && (scalefac_band_long[index] > bigvalues_region) )
-      {
-        thiscount--;
-        index--;
-      }
-      cod_info->region0_count = thiscount;
-
-      cod_info->region1_count = subdv_table[scfb_anz].region1_count;
-      index = cod_info->region0_count + cod_info->region1_count + 2;
-      thiscount = cod_info->region1_count;
-      while ( thiscount && (scalefac_band_long[index] > bigvalues_region) )
-      {
-        thiscount--;
-        index--;
-      }
-      cod_info->region1_count = thiscount;
-      cod_info->address1 = scalefac_band_long[cod_info->region0_count+1];
-      cod_info->address2 = scalefac_band_long[cod_info->region0_count
-                                            + cod_info->region1_count + 2 ];
-      cod_info->address3 = bigvalues_region;
-    }
-  }
-}
-
-/*
- * bigv_tab_select:
- * ----------------
- * Function: Select huffman code tables for bigvalues regions
- */
-void bigv_tab_select( int ix[samp_per_frame2], gr_info *cod_info )
-{
-  cod_info->table_select[0] = 0;
-  cod_info->table_select[1] = 0;
-  cod_info->table_select[2] = 0;
-
-  {
-    if ( cod_info->address1 > 0 )
-      cod_info->table_select[0] = new_choose_table( ix, 0, cod_info->address1 );
-
-    if ( cod_info->address2 > cod_info->address1 )
-      cod_info->table_select[1] = new_choose_table( ix, cod_info->address1, cod_info->address2 );
-
-    if ( cod_info->big_values<<1 > cod_info->address2 )
-      cod_info->table_select[2] = new_choose_table( ix, cod_info->address2, cod_info->big_values<<1 );
-  }
-}
-
-/*
- * new_choose_table:
- * -----------------
- * Choose the Huffman table that will encode ix[begin..end] with
- * the fewest bits.
+ * choose_table:
+ * -------------
+ * Choose the Huffman table that will encode a region with the fewest
+ * bits, from the packed costs of the region and its maximum value, and
+ * return that number of bits in #bits#.
  * Note: This code contains knowledge about the sizes and characteristics
  * of the Huffman tables as defined in the IS (Table B.7), and will not work
  * with any arbitrary tables.
  */
-int new_choose_table( int ix[samp_per_frame2], unsigned int begin, unsigned int end )
+int choose_table( uint64_t cost[4], int max, int *bits )
 {
-  int i, max;
+  int i, g, esc;
   int choice[2];
   int sum[2];
 
-  max = ix_max(ix,begin,end);
+  *bits = 0;
   if(!max)
     return 0;
 
-  choice[0] = 0;
-  choice[1] = 0;
-
   if(max<15)
   {
-    /* try tables with no linbits */
-    for ( i =14; i--; )
-      if ( shine_huffman_table[i].xlen > max )
+    /* try the smallest tables with no linbits that fit */
+    for ( g = 0; hgroup[g].xlen <= max; g++ )
+      ;
+
+    i = hgroup[g].first;
+    choice[0] = htable[i];
+    sum[0]    = hfield(cost,i);
+    for ( i++; i < hgroup[g].first + hgroup[g].n; i++ )
+    {
+      sum[1] = hfield(cost,i);
+      if ( sum[1] <= sum[0] )
       {
-        choice[0] = i;
-        break;
+        choice[0] = htable[i];
+        sum[0]    = sum[1];
       }
-
-    sum[0] = count_bit( ix, begin, end, choice[0] );
-
-    switch (choice[0])
-    {
-      case 2:
-        sum[1] = count_bit( ix, begin, end, 3 );
-        if ( sum[1] <= sum[0] )
-          choice[0] = 3;
-        break;
-
-      case 5:
-        sum[1] = count_bit( ix, begin, end, 6 );
-        if ( sum[1] <= sum[0] )
-          choice[0] = 6;
-        break;
-
-      case 7:
-        sum[1] = count_bit( ix, begin, end, 8 );
-        if ( sum[1] <= sum[0] )
-        {
-          choice[0] = 8;
-          sum[0] = sum[1];
-        }
-        sum[1] = count_bit( ix, begin, end, 9 );
-        if ( sum[1] <= sum[0] )
-          choice[0] = 9;
-        break;
-
-      case 10:
-        sum[1] = count_bit( ix, begin, end, 11 );
-        if ( sum[1] <= sum[0] )
-        {
-          choice[0] = 11;
-          sum[0] = sum[1];
-        }
-        sum[1] = count_bit( ix, begin, end, 12 );
-        if ( sum[1] <= sum[0] )
-          choice[0] = 12;
-        break;
-
-      case 13:
-        sum[1] = count_bit( ix, begin, end, 15 );
-        if ( sum[1] <= sum[0] )
-          choice[0] = 15;
-        break;
     }
   }
   else
@@ -710,6 +1274,9 @@ int new_choose_table( int ix[samp_per_frame2], unsigned int begin, unsigned int
     /* try tables with linbits */
     max -= 15;
 
+    choice[0] = 0;
+    choice[1] = 0;
+
     for(i=15;i<24;i++)
       if(shine_huffman_table[i].linmax>=max)
       {
@@ -724,142 +1291,302 @@ int new_choose_table( int ix[samp_per_frame2], unsigned int begin, unsigned int
         break;
       }
 
-    sum[0] = count_bit(ix,begin,end,choice[0]);
-    sum[1] = count_bit(ix,begin,end,choice[1]);
+    esc = hfield(cost,HFIELD_ESC);
+    if (choice[0] == 15)
+      sum[0] = hfield(cost,HFIELD_15);
+    else
+      sum[0] = hfield(cost,HFIELD_16) + esc * shine_huffman_table[choice[0]].linbits;
+    sum[1] = hfield(cost,HFIELD_24) + esc * shine_huffman_table[choice[1]].linbits;
+
     if (sum[1]<sum[0])
+    {
       choice[0] = choice[1];
+      sum[0]    = sum[1];
+    }
   }
+
+  *bits = sum[0];
   return choice[0];
 }
 
 /*
- * bigv_bitcount:
- * --------------
- * Function: Count the number of bits necessary to code the bigvalues region.
+ * region_bits:
+ * ------------
+ * Bits of the region made of the bands #begin#..#end#-1, with the
+ * maximum value #max#, and its table in #table#.
  */
-int bigv_bitcount(int ix[samp_per_frame2], gr_info *gi)
+int region_bits( uint64_t cost[][4], int begin, int end, int max, unsigned *table )
 {
-  int bits = 0;
-  unsigned int table;
-
-  if( (table=gi->table_select[0]))  /* region0 */
-    bits += count_bit(ix, 0, gi->address1, table );
-  if( (table=gi->table_select[1]))  /* region1 */
-    bits += count_bit(ix, gi->address1, gi->address2, table );
-  if( (table=gi->table_select[2]))  /* region2 */
-    bits += count_bit(ix, gi->address2, gi->address3, table );
+  uint64_t c[4];
+  int k, bits;
+
+  if(begin >= end)
+  {
+    *table = 0;
+    return 0;
+  }
+
+  /* the fields never borrow, the index only grows */
+  for(k=4; k--; )
+    c[k] = cost[end][k] - cost[begin][k];
+
+  *table = choose_table(c, max, &bits);
   return bits;
 }
 
 /*
- * count_bit:
- * ----------
- * Function: Count the number of bits necessary to code the subregion.
+ * split_bits:
+ * -----------
+ * Bits of the bigvalues region of #n# bands split into region0 = bands
+ * 0..a-1, region1 = a..b-1 and region2 = b..n-1, and the three tables.
  */
-int count_bit(int ix[samp_per_frame2],
-              unsigned int start,
-              unsigned int end,
-              unsigned int table )
+int split_bits( uint64_t cost[][4], int bmax[], int n, int a, int b, unsigned table[3] )
 {
-  unsigned            linbits, ylen;
-  register int        i, sum;
-  register int        x,y;
-  struct huffcodetab *h;
+  int i, max, bits;
 
-  if(!table)
-    return 0;
+  if ( a > n ) a = n;
+  if ( b > n ) b = n;
+
+  for ( i=0, max=0; i<a; i++ )
+    if ( bmax[i] > max ) max = bmax[i];
+  bits  = region_bits(cost, 0, a, max, &table[0]);
+
+  for ( max=0; i<b; i++ )
+    if ( bmax[i] > max ) max = bmax[i];
+  bits += region_bits(cost, a, b, max, &table[1]);
+
+  for ( max=0; i<n; i++ )
+    if ( bmax[i] > max ) max = bmax[i];
+  bits += region_bits(cost, b, n, max, &table[2]);
+
+  return bits;
+}
+
+/*
+ * subdivide:
+ * ----------
+ * Subdivides the bigvalue region into the three regions which use
+ * separate Huffman tables, selects their tables and returns the number
+ * of bits necessary to code the bigvalues region.
+ * A single pass sums the packed costs of all the tables (hcost) into a
+ * cumulative index over the scalefactor bands, so the bits of any run of
+ * bands is a subtraction.  With #search# all the legal region0/region1
+ * splits (up to 16 and 8 bands) are tried and the best one is kept,
+ * otherwise the split comes from subdv_table, which is good enough for
+ * the coarse step size search.
+ */
+int subdivide( int ix[samp_per_frame2], gr_info *cod_info, int search, shine_global_config *config )
+{
+  static struct
+  {
+    unsigned region0_count;
+    unsigned region1_count;
+  } subdv_table[ 23 ] =
+  {
+    {0, 0}, /* 0 bands */
+    {0, 0}, /* 1 bands */
+    {0, 0}, /* 2 bands */
+    {0, 0}, /* 3 bands */
+    {0, 0}, /* 4 bands */
+    {0, 1}, /* 5 bands */
+    {1, 1}, /* 6 bands */
+    {1, 1}, /* 7 bands */
+    {1, 2}, /* 8 bands */
+    {2, 2}, /* 9 bands */
+    {2, 3}, /* 10 bands */
+    {2, 3}, /* 11 bands */
+    {3, 4}, /* 12 bands */
+    {3, 4}, /* 13 bands */
+    {3, 4}, /* 14 bands */
+    {4, 5}, /* 15 bands */
+    {4, 5}, /* 16 bands */
+    {4, 6}, /* 17 bands */
+    {5, 6}, /* 18 bands */
+    {5, 6}, /* 19 bands */
+    {5, 7}, /* 20 bands */
+    {6, 7}, /* 21 bands */
+    {6, 7}, /* 22 bands */
+  };
 
-  h   = &(shine_huffman_table[table]);
-  sum = 0;
+  uint64_t cost[SFB_LMAX+1][4];
+  uint64_t *h;
+  int bmax[SFB_LMAX+1];
+  int bits0, bits1, bits2[SFB_LMAX+1];
+  unsigned t[3] = {0, 0, 0}, t0, t1, t2[SFB_LMAX+1];
+  int bigvalues_region, best;
+  int n, i, k, a, b, x, y, max, max0, max1;
 
-  ylen    = h->ylen;
-  linbits = h->linbits;
+  bigvalues_region = cod_info->big_values<<1;
 
-  if(table>15)
-  { /* ESC-table is used */
-    for(i=start;i<end;i+=2)
+  cod_info->region0_count   = 0;
+  cod_info->region1_count   = 0;
+  cod_info->table_select[0] = 0;
+  cod_info->table_select[1] = 0;
+  cod_info->table_select[2] = 0;
+  cod_info->address1 = 0;
+  cod_info->address2 = 0;
+  cod_info->address3 = bigvalues_region;
+
+  if ( !bigvalues_region )
+    return 0; /* no big_values region */
+
+  /* cumulative costs and maxima of the bands of the bigvalues region,
+   * the last band may end early */
+  for ( k=4; k--; )
+    cost[0][k] = 0;
+  for ( n=0; scalefac_band_long[n] < bigvalues_region; n++ )
+  {
+    for ( k=4; k--; )
+      cost[n+1][k] = cost[n][k];
+    max = 0;
+    for ( i=scalefac_band_long[n]; i<scalefac_band_long[n+1] && i<bigvalues_region; i+=2 )
     {
       x = ix[i];
       y = ix[i+1];
-      if(x>14)
-      {
-        x = 15;
-        sum += linbits;
-      }
-      if(y>14)
-      {
-        y = 15;
-        sum += linbits;
-      }
-
-      sum += h->hlen[(x*ylen)+y];
-      if(x)
-        sum++;
-      if(y)
-        sum++;
+      if ( x > max ) max = x;
+      if ( y > max ) max = y;
+      if ( x > 15 ) x = 15;
+      if ( y > 15 ) y = 15;
+      h = config->l3loop.hcost[(x<<4)+y];
+      cost[n+1][0] += h[0];
+      cost[n+1][1] += h[1];
+      cost[n+1][2] += h[2];
+      cost[n+1][3] += h[3];
     }
+    bmax[n] = max;
+  }
+
+  if ( !search )
+  {
+    /* region boundaries from the table, within the bigvalues region */
+    a = subdv_table[n].region0_count + 1;
+    while ( a > 1 && scalefac_band_long[a] > bigvalues_region )
+      a--;
+    b = a + subdv_table[n].region1_count + 1;
+    while ( b > a + 1 && scalefac_band_long[b] > bigvalues_region )
+      b--;
+
+    best = split_bits(cost, bmax, n, a, b, t);
+    cod_info->region0_count = a - 1;
+    cod_info->region1_count = b - a - 1;
   }
   else
-  { /* No ESC-words */
-    for(i=start;i<end;i+=2)
+  {
+    /* region2 starting at each band */
+    for ( b=n, max=0; b--; )
     {
-      x = ix[i];
-      y = ix[i+1];
+      if ( bmax[b] > max ) max = bmax[b];
+      bits2[b] = region_bits(cost, b, n, max, &t2[b]);
+    }
+    bits2[n] = 0;
+    t2[n]    = 0;
+
+    /* region0 is bands 0..a-1, region1 a..b-1 and region2 b..n-1 */
+    best = -1;
+    for ( a=1, max0=0; a<=16 && a<=n; a++ )
+    {
+      if ( bmax[a-1] > max0 ) max0 = bmax[a-1];
+      bits0 = region_bits(cost, 0, a, max0, &t0);
+      if ( best >= 0 && bits0 >= best )
+        break; /* region0 only grows from here */
 
-      sum  += h->hlen[(x*ylen)+y];
+      for ( b=a+1, max1=0; b<=a+8; b++ )
+      {
+        if ( b <= n && bmax[b-1] > max1 ) max1 = bmax[b-1];
+        bits1 = region_bits(cost, a, b<n ? b : n, max1, &t1);
 
-      if(x!=0)
-        sum++;
-      if(y!=0)
-        sum++;
+        if ( best < 0 || bits0 + bits1 + bits2[b<n ? b : n] < best )
+        {
+          best = bits0 + bits1 + bits2[b<n ? b : n];
+          cod_info->region0_count = a - 1;
+          cod_info->region1_count = b - a - 1;
+          t[0] = t0;
+          t[1] = t1;
+          t[2] = t2[b<n ? b : n];
+        }
+
+        if ( b >= n )
+          break;
+      }
     }
   }
-  return sum;
+
+  cod_info->table_select[0] = t[0];
+  cod_info->table_select[1] = t[1];
+  cod_info->table_select[2] = t[2];
+
+  a = cod_info->region0_count + 1;
+  b = a + cod_info->region1_count + 1;
+  cod_info->address1 = a<n ? scalefac_band_long[a] : bigvalues_region;
+  cod_info->address2 = b<n ? scalefac_band_long[b] : bigvalues_region;
+
+  return best;
 }
 
 /*
  * bin_search_StepSize:
  * --------------------
- * Succesive approximation approach to obtaining a initial quantizer
- * step size.
- * The following optional code written by Seymour Shlien
- * will speed up the shine_outer_loop code which is called
- * by iteration_loop. When BIN_SEARCH is defined, the
- * shine_outer_loop function precedes the call to the function shine_inner_loop
- * with a call to bin_search gain defined below, which
- * returns a good starting quantizerStepSize.
+ * Finds the smallest quantizer step size in -124..0 for which the
+ * bigvalues and count1 regions fit in #desired_rate# bits (0 when none
+ * fits).
+ * Consecutive granules of a channel end up on nearly the same step size,
+ * moved by their change of energy: 4 steps double the amplitude, so 2
+ * steps per doubling of en_tot.  The search starts from that prediction,
+ * doubles its stride away from it until the answer is bracketed and then
+ * bisects the bracket, which usually takes 3 or 4 quantizations instead
+ * of the 7 of a cold binary search.
  */
-int bin_search_StepSize(int desired_rate, int ix[samp_per_frame2],
-                        gr_info * cod_info, shine_global_config *config)
+int bin_search_StepSize(int desired_rate, gr_info * cod_info, int gr, int ch,
+                        shine_global_config *config)
 {
-  int top,bot,next,last,bit;
+  l3loop_t *l3loop = &config->l3loop;
+  quant_t *q;
+  int lo, hi, next, bit, stride;
+
+  if (l3loop->laststep[ch] > 0)
+    next = -60; /* no previous granule, start in the middle */
+  else
+    next = l3loop->laststep[ch] + 2*(l3loop->en_tot[gr][ch] - l3loop->lasten[ch]);
+  if (next < -124)
+    next = -124;
+  if (next > 0)
+    next = 0;
 
-  top  = -120;
-  bot  = 0;
-  next = top;
+  lo = -125; /* largest step size known not to fit */
+  hi = 1;    /* smallest step size known to fit */
+  stride = 1;
 
   do
   {
-    last = next;
-    next = (top+bot) >> 1;
-
-      if (quantize(ix,next,config) > 8192)
+    q = quantize(next,config);
+    if (q->max > 8192)
       bit = 100000;  /* fail */
     else
     {
-      calc_runlen(ix,cod_info);            /* rzero,count1,big_values */
-      bit = count1_bitcount(ix, cod_info); /* count1_table selection */
-      subdivide(cod_info);                 /* bigvalues sfb division */
-      bigv_tab_select(ix,cod_info);        /* codebook selection */
-      bit += bigv_bitcount(ix,cod_info);   /* bit count */
+      if (q->bits < 0)
+      {
+        calc_runlen(q->ix,cod_info);            /* rzero,count1,big_values */
+        q->bits = count1_bitcount(q->ix, cod_info); /* count1_table selection */
+        q->bits += subdivide(q->ix,cod_info,0,config); /* bigvalues sfb division, codebook selection and bit count */
+        q->end = (cod_info->big_values<<1) + (cod_info->count1<<2);
+      }
+      bit = q->bits;
     }
 
     if (bit>desired_rate)
-      top = next;
+      lo = next;
     else
-      bot = next;
+      hi = next;
+
+    if (hi > 0)          /* nothing fits yet, go up */
+      next = (lo + stride < 0) ? lo + stride : 0;
+    else if (lo < -124)  /* everything fits so far, go down */
+      next = (hi - stride > -124) ? hi - stride : -124;
+    else                 /* bracketed */
+      next = (lo + hi) >> 1;
+    stride <<= 1;
   }
-  while((bit!=desired_rate) && abs(last-next)>1);
-  return next;
-}
+  while (hi - lo > 1);
 
+  return hi > 0 ? 0 : hi;
+}
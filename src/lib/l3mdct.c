@@ -2,6 +2,7 @@
 
 #include "types.h"
 #include "l3mdct.h"
+#include "kernels.h"
 
 /*extern long mul(long x, long y); */ /* inlined in header file */
 /*extern long muls(long x, long y); */ /* inlined in header file */
@@ -12,98 +13,259 @@ static double c[8] = { -0.6,-0.535,-0.33,-0.185,-0.095,-0.041,-0.0142, -0.0037 }
 /*
  * shine_mdct_initialise:
  * -------------------
+ * The granule kernel is chosen for the cpu here, the SIMD ones only
+ * implement the fast MDCT.
+ * The analysis filterbank inverts every odd subband sample of the odd
+ * bands, the window (or the combined direct table) of the odd bands is
+ * negated at the odd samples to compensate.
  */
 void shine_mdct_initialise(shine_global_config *config)
 {
   int i,m,k;
   double sq;
+#ifndef DIRECT_MDCT
+  int n;
+#endif
 
   /* prepare the aliasing reduction butterflies */
   for(i=8; i--; )
   {
     sq = sqrt(1.0 + (c[i] * c[i]));
     /* scale and convert to fixed point before storing */
-    config->mdct.ca[i] = (long)(c[i] / sq * 0x7fffffff);
-    config->mdct.cs[i] = (long)(1.0  / sq * 0x7fffffff);
+    config->mdct.ca[i] = (int32_t)(c[i] / sq * 0x7fffffff);
+    config->mdct.cs[i] = (int32_t)(1.0  / sq * 0x7fffffff);
   }
 
+  config->mdct.granule = shine_mdct_granule_c;
+#if defined(SHINE_X86) && !defined(DIRECT_MDCT)
+  i = shine_cpu_features();
+  if (i & SHINE_CPU_AVX2)
+    config->mdct.granule = shine_mdct_granule_avx2;
+  else if (i & SHINE_CPU_SSE2)
+    config->mdct.granule = shine_mdct_granule_sse2;
+#endif
+
+#ifdef DIRECT_MDCT
   /* prepare the mdct coefficients */
   for(m=18; m--; )
     for(k=36; k--; )
+    {
       /* combine window and mdct coefficients into a single table */
-      /* scale and convert to fixed point before storing */
-      config->mdct.cos_l[m][k] = (long)(sin(PI36*(k+0.5))
-                                      * cos((PI/72)*(2*k+19)*(2*m+1)) * 0x7fffffff);
+      /* scale to Q30 for the guard bit of the output, see mdct_long */
+      config->mdct.cos_l[0][m][k] = (int32_t)(sin(PI36*(k+0.5))
+                                      * cos((PI/72)*(2*k+19)*(2*m+1)) * 0x3fffffff);
+      config->mdct.cos_l[1][m][k] = (k&1) ? -config->mdct.cos_l[0][m][k] : config->mdct.cos_l[0][m][k];
+    }
+#else
+  /* prepare the fast mdct tables, see mdct_long */
+  for(k=36; k--; )
+    for(i=8; i--; )
+    {
+      config->mdct.win[k][i] = (int32_t)(sin(PI36*(k+0.5)) * 0x1fffffff); /* Q29 */
+      if(i & k & 1)
+        config->mdct.win[k][i] = -config->mdct.win[k][i];
+    }
+  for(n=8; n--; )
+    for(i=4; i--; )
+      config->mdct.cos9[n][i] = (int32_t)(cos(PI*(n+1)*(2*i+1)/18) * 0x7fffffff);
+  /* scale and convert to Q27 fixed point before storing */
+  for(i=9; i--; )
+    config->mdct.sc9[i]  = (int32_t)(0.5/cos(PI*(2*i+1)/36) * (1<<27) + 0.5);
+  for(m=18; m--; )
+    config->mdct.sc18[m] = (int32_t)(0.5/cos(PI*(2*m+1)/72) * (1<<27) + 0.5);
+#endif
+}
+
+#ifndef DIRECT_MDCT
+/*
+ * dct9:
+ * -----
+ * In place 9 point DCT-III, a[i] = sum(n=0..8) a[n] * cos(PI*n*(2i+1)/18).
+ * Outputs i and 8-i share the even terms and negate the odd ones, and
+ * the middle output only needs the even terms.
+ */
+static void dct9(int32_t a[9], int32_t c[8][4])
+{
+  int32_t ev, od;
+  int32_t x[9];
+  int i;
+
+  for(i=9; i--; )
+    x[i] = a[i];
+
+  for(i=4; i--; )
+  {
+    ev = x[0] + muls(x[2],c[1][i]) + muls(x[4],c[3][i])
+              + muls(x[6],c[5][i]) + muls(x[8],c[7][i]);
+    od = muls(x[1],c[0][i]) + muls(x[3],c[2][i])
+       + muls(x[5],c[4][i]) + muls(x[7],c[6][i]);
+    a[i]   = ev + od;
+    a[8-i] = ev - od;
+  }
+  a[4] = x[0] - x[2] + x[4] - x[6] + x[8];
+}
+
+/*
+ * mdct_long:
+ * ----------
+ * Fast long block MDCT of 36 subband samples to 18 lines.
+ * The windowed input is folded to an 18 point DCT-IV, which is computed
+ * as a DCT-III of the pairwise summed input scaled by 1/(2cos), and the
+ * DCT-III is split into two 9 point ones (Lee).  That is about 130
+ * multiplies instead of 648.
+ * Half the transform does not fit: a full scale low frequency input gives
+ * lines of up to 1.84 times full scale after the aliasing reduction.  So
+ * the output is a quarter of the transform, like the direct version, and
+ * global_gain is raised to compensate.  With the Q29 window the windowed
+ * input is at most 0.06 of full scale, the pairwise sums u[] 0.12, the
+ * 9 point DCT outputs 0.90, e[i]+-t 0.91 and the output 0.92.
+ */
+static void mdct_long(int32_t out[18], int32_t in[36], int odd, mdct_t *mdct)
+{
+  int32_t x[36], u[18], e[9], o[9], t;
+  int64_t v;
+  int i;
+
+  for(i=36; i--; )
+    x[i] = mul(in[i],mdct->win[i][odd]);
+
+  /* fold (a,b,c,d) to (-c'-d, a-b') and sum pairwise */
+  for(i=9; i--; )
+  {
+    u[i]   = -x[26-i] - x[27+i];
+    u[i+9] =  x[i]    - x[17-i];
+  }
+  for(i=17; i; i--)
+    u[i] += u[i-1];
+
+  /* 18 point DCT-III as two 9 point ones */
+  for(i=9; i--; )
+  {
+    e[i] = u[i<<1];
+    o[i] = u[(i<<1)+1] + (i ? u[(i<<1)-1] : 0);
+  }
+  dct9(e,mdct->cos9);
+  dct9(o,mdct->cos9);
+
+  for(i=9; i--; )
+  {
+    t = mul27(o[i],mdct->sc9[i]);
+    v = (int64_t)e[i] + t;
+    out[i]    = sat32((v * mdct->sc18[i]) >> 26);
+    v = (int64_t)e[i] - t;
+    out[17-i] = sat32((v * mdct->sc18[17-i]) >> 26);
+  }
+}
+#endif
+
+/*
+ * shine_mdct_alias:
+ * -----------------
+ * Aliasing reduction butterflies between the bands #first#..31 of a
+ * band interleaved granule, out[k][band].
+ */
+void shine_mdct_alias(int32_t out[18][SBLIMIT], int first, mdct_t *mdct)
+{
+  int32_t bu,bd;
+  int band,k;
+
+  for(band=first; band<31; band++)
+    for(k=8; k--; )
+    {
+      /* must left justify result of multiplication here because the centre
+       * two values in each block are not touched.
+       */
+      bu = muls(out[17-k][band],mdct->cs[k]) + muls(out[k][band+1],mdct->ca[k]);
+      bd = muls(out[k][band+1],mdct->cs[k]) - muls(out[17-k][band],mdct->ca[k]);
+      out[17-k][band] = bu;
+      out[k][band+1]  = bd;
+    }
+}
+
+/*
+ * shine_mdct_granule_c:
+ * ---------------------
+ * Reference granule kernel: MDCT of the 18 previous and 18 current
+ * subband samples prev[k][band], cur[k][band] of each band to the 18
+ * lines out[k][band], followed by the aliasing reduction.  All sides are
+ * band interleaved, so the SIMD kernels can work on neighbouring bands
+ * at once.
+ */
+void shine_mdct_granule_c(int32_t prev[18][SBLIMIT], int32_t cur[18][SBLIMIT], int32_t out[18][SBLIMIT], mdct_t *mdct)
+{
+  int32_t mdct_in[36], mdct_out[18];
+  int band,k;
+#ifdef DIRECT_MDCT
+  int64_t sum;
+  int j;
+#endif
+
+  for(band=32; band--; )
+  {
+    for(k=18; k--; )
+    {
+      mdct_in[k]    = prev[k][band];
+      mdct_in[k+18] = cur[k][band];
+    }
+
+    /* Calculation of the MDCT
+     * In the case of long blocks ( block_type 0,1,3 ) there are
+     * 36 coefficients in the time domain and 18 in the frequency
+     * domain.
+     */
+#ifdef DIRECT_MDCT
+    /* the partial sums can exceed the 0.92 of the result, see mdct_long */
+    for(k=18; k--; )
+    {
+      for(j=36, sum=0; j--; )
+        sum += (int64_t)mdct_in[j] * mdct->cos_l[band&1][k][j];
+      mdct_out[k] = sat32(sum >> 32);
+    }
+#else
+    mdct_long(mdct_out,mdct_in,band&1,mdct);
+#endif
+
+    for(k=18; k--; )
+      out[k][band] = mdct_out[k];
+  }
+
+  shine_mdct_alias(out,0,mdct);
 }
 
 /*
  * shine_mdct_sub:
  * ------------
+ * The subband samples are a ring of three granules, the frame's two
+ * granules follow the one of the previous frame they overlap with, so
+ * nothing has to be copied between frames.
  */
 void shine_mdct_sub(shine_global_config *config)
 {
   /* note. we wish to access the array 'config->mdct_freq[2][2][576]' as
    * [2][2][32][18]. (32*18=576),
    */
-  long (*mdct_enc)[18];
+  int32_t (*mdct_enc)[18];
 
-  int  ch,gr,band,j,k;
-  long mdct_in[36];
-  long bu,bd,*m;
+  int  ch,gr,band,k,prev,cur;
+  int32_t mdct_out[18][SBLIMIT];
 
   for(gr=0; gr<2; gr++)
     for(ch=config->wave.channels; ch--; )
     {
       /* set up pointer to the part of config->mdct_freq we're using */
-      mdct_enc = (long (*)[18]) config->mdct_freq[gr][ch];
-
-      /* Compensate for inversion in the analysis filter
-       * (every odd index of band AND k)
-       */
-      for(band=1; band<=31; band+=2 )
-        for(k=1; k<=17; k+=2 )
-          config->l3_sb_sample[ch][gr+1][k][band] *= -1;
+      mdct_enc = (int32_t (*)[18]) config->mdct_freq[gr][ch];
 
       /* Perform imdct of 18 previous subband samples + 18 current subband samples */
+      prev = (config->sb_granule + gr) % 3;
+      cur  = (config->sb_granule + gr + 1) % 3;
+      config->mdct.granule(config->l3_sb_sample[ch][prev],config->l3_sb_sample[ch][cur],
+                           mdct_out,&config->mdct);
+
       for(band=32; band--; )
-      {
         for(k=18; k--; )
-        {
-          mdct_in[k]    = config->l3_sb_sample[ch][ gr ][k][band];
-          mdct_in[k+18] = config->l3_sb_sample[ch][gr+1][k][band];
-        }
-
-        /* Calculation of the MDCT
-         * In the case of long blocks ( block_type 0,1,3 ) there are
-         * 36 coefficients in the time domain and 18 in the frequency
-         * domain.
-         */
-        for(k=18; k--; )
-        {
-          m = &mdct_enc[band][k];
-          for(j=36, *m=0; j--; )
-            *m += mul(mdct_in[j],config->mdct.cos_l[k][j]);
-        }
-      }
-
-      /* Perform aliasing reduction butterfly */
-      for(band=31; band--; )
-        for(k=8; k--; )
-        {
-          /* must left justify result of multiplication here because the centre
-           * two values in each block are not touched.
-           */
-          bu = muls(mdct_enc[band][17-k],config->mdct.cs[k]) + muls(mdct_enc[band+1][k],config->mdct.ca[k]);
-          bd = muls(mdct_enc[band+1][k],config->mdct.cs[k]) - muls(mdct_enc[band][17-k],config->mdct.ca[k]);
-          mdct_enc[band][17-k] = bu;
-          mdct_enc[band+1][k]  = bd;
-        }
+          mdct_enc[band][k] = mdct_out[k][band];
     }
 
-  /* Save latest granule's subband samples to be used in the next mdct call */
-  for(ch=config->wave.channels ;ch--; )
-    for(j=18; j--; )
-      for(band=32; band--; )
-        config->l3_sb_sample[ch][0][j][band] = config->l3_sb_sample[ch][2][j][band];
+  /* the latest granule overlaps with the next frame */
+  config->sb_granule = (config->sb_granule + 2) % 3;
 }
-
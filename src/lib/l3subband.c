@@ -3,6 +3,7 @@
 #include "types.h"
 #include "tables.h"
 #include "l3subband.h"
+#include "kernels.h"
 
 /*
  * shine_subband_initialise:
@@ -10,18 +11,32 @@
  * Calculates the analysis filterbank coefficients and rounds to the
  * 9th decimal place accuracy of the filterbank tables in the ISO
  * document.  The coefficients are stored in #filter#
+ * The fast matrixing only needs the 1/(2cos) factors of the DCT-32,
+ * stored in #dct# for each stage length n as dct[n/2-1+i].
+ * The window and matrixing kernel is chosen for the cpu here, the SIMD
+ * ones only implement the fast matrixing.
  */
 void shine_subband_initialise(shine_global_config *config)
 {
   int i,j;
+#ifdef DIRECT_SUBBAND
   double filter;
+#endif
 
-  config->subband.off[0] = config->subband.off[1] = 0;
+  config->subband.filter = shine_subband_filter_c;
+#if defined(SHINE_X86) && !defined(DIRECT_SUBBAND)
+  i = shine_cpu_features();
+  if (i & SHINE_CPU_AVX2)
+    config->subband.filter = shine_subband_filter_avx2;
+  else if (i & SHINE_CPU_SSE2)
+    config->subband.filter = shine_subband_filter_sse2;
+#endif
 
   for(i=2; i-- ; )
-    for(j=HAN_SIZE; j--; )
+    for(j=HAN_SIZE-32+samp_per_frame2; j--; )
       config->subband.x[i][j] = 0;
 
+#ifdef DIRECT_SUBBAND
   for (i=SBLIMIT; i--; )
     for (j=64; j--; )
     {
@@ -30,50 +45,134 @@ void shine_subband_initialise(shine_global_config *config)
       else
         modf(filter-0.5, &filter);
       /* scale and convert to fixed point before storing */
-      config->subband.fl[i][j] = (long)(filter * (0x7fffffff * 1e-9));
+      config->subband.fl[i][j] = (int32_t)(filter * (0x7fffffff * 1e-9));
     }
+#endif
+
+  for (j=2; j<=SBLIMIT; j<<=1)
+    for (i=j>>1; i--; )
+      /* scale and convert to Q27 fixed point before storing */
+      config->subband.dct[(j>>1)-1+i] = (int32_t)(0.5/cos(PI*(2*i+1)/(2*j)) * (1<<27) + 0.5);
 
   /* note. 0.035781 is shine_enwindow maximum value */
-  /* scale and convert to fixed point before storing */
+  /* scale and convert to fixed point before storing, reversed */
   for (i=HAN_SIZE; i--;)
-    config->subband.ew[i] = (long)(shine_enwindow[i] * 0x7fffffff);
+    config->subband.ew[HAN_SIZE-1-i] = (int32_t)(shine_enwindow[i] * 0x7fffffff);
 }
 
+#ifndef DIRECT_SUBBAND
 /*
- * shine_window_filter_subband:
- * -------------------------
- * Overlapping window on PCM samples
- * 32 16-bit pcm samples are scaled to fractional 2's complement and
- * concatenated to the end of the window buffer #x#. The updated window
- * buffer #x# is then windowed by the analysis window #shine_enwindow# to produce
- * the windowed sample #z#
- * Calculates the analysis filter bank coefficients
- * The windowed samples #z# is filtered by the digital filter matrix #filter#
- * to produce the subband samples #s#. This done by first selectively
- * picking out values from the windowed samples, and then multiplying
- * them by the filter matrix, producing 32 subband samples.
+ * subband_dct:
+ * ------------
+ * In place DCT-III of length #n# (a power of two):
+ *   a[i] = sum(k=0..n-1) a[k] * cos(PI*k*(2i+1)/(2n))
+ * using Lee's factorisation: the even inputs form a half length DCT-III,
+ * the odd inputs summed pairwise form another one whose outputs are
+ * scaled by 1/(2cos(PI*(2i+1)/(2n))), then both halves are butterflied.
  */
-void shine_window_filter_subband(int16_t **buffer, long s[SBLIMIT] , int k, shine_global_config *config)
+static void subband_dct(int32_t *a, int n, int32_t *c)
 {
-  long y[64];
-  int i,j;
+  int32_t even[SBLIMIT/2], odd[SBLIMIT/2], o;
+  int i, h = n>>1;
+
+  if (n == 1)
+    return;
 
-  /* replace 32 oldest samples with 32 new samples */
-  for (i=31;i>=0;i--)
-    config->subband.x[k][i+config->subband.off[k]] = ((long)*(*buffer)++) << 16;
+  for (i=0; i<h; i++)
+  {
+    even[i] = a[i<<1];
+    odd[i]  = a[(i<<1)+1] + (i ? a[(i<<1)-1] : 0);
+  }
+  subband_dct(even, h, c);
+  subband_dct(odd,  h, c);
 
-  /* shift samples into proper window positions */
-  for (i=HAN_SIZE; i--; )
-    config->subband.z[k][i] = mul(config->subband.x[k][(i+config->subband.off[k])&(HAN_SIZE-1)],config->subband.ew[i]);
+  for (i=0; i<h; i++)
+  {
+    o = mul27(odd[i], c[h-1+i]);
+    a[i]     = even[i] + o;
+    a[n-1-i] = even[i] - o;
+  }
+}
+#endif
 
-  config->subband.off[k] = (config->subband.off[k] + 480) & (HAN_SIZE-1); /* offset is modulo (HAN_SIZE)*/
+/*
+ * shine_subband_filter_c:
+ * -----------------------
+ * Reference window and matrixing kernel.
+ * For each of the 18 time slots, the 512 samples of #x# ending with the
+ * slot's 32 new ones are windowed by the analysis window #shine_enwindow#
+ * and folded to 64 values #y#, which are filtered by the digital filter
+ * matrix #filter# to produce the 32 subband samples of #s#.
+ * The filter matrix cos((2i+1)(16-j)PI/64) is symmetric about j=16 and
+ * antisymmetric about j=48, so the 64 values are first folded to 32 and
+ * the product becomes a DCT-32 (O(N log N) instead of 2048 multiplies).
+ * The fast version stays within 64 LSB of the direct one (DIRECT_SUBBAND),
+ * i.e. below -150dB of full scale; most of that difference is the
+ * truncation bias of the 64 direct products, the fast one is closer to
+ * the exact transform.
+ * Unlike the MDCT no guard bits are needed: for a full scale input the
+ * values y[] are at most 0.022 of full scale, the DCT-32 intermediates
+ * 0.85 and the subband samples 0.42, so int32_t lanes cannot wrap.
+ */
+void shine_subband_filter_c(int32_t *x, int32_t s[18][SBLIMIT], subband_t *subband)
+{
+  int32_t y[64];
+  int i,j,t;
 
-  for (i=64; i--; )
-    for (j=8, y[i] = 0; j--; )
-      y[i] += config->subband.z[k][i+(j<<6)];
+  for (t=0; t<18; t++, x+=32)
+  {
+    /* window the 512 samples ending with this slot, the window is stored
+     * reversed so it lines up with the time ordered buffer */
+    for (i=64; i--; )
+      for (j=8, y[63-i] = 0; j--; )
+        y[63-i] += mul(x[i+(j<<6)],subband->ew[i+(j<<6)]);
 
-  for (i=SBLIMIT; i--; )
-    for (j=64, s[i]= 0; j--; )
-      s[i] += mul(config->subband.fl[i][j],y[j]);
+#ifdef DIRECT_SUBBAND
+    for (i=SBLIMIT; i--; )
+      for (j=64, s[t][i]= 0; j--; )
+        s[t][i] += mul(subband->fl[i][j],y[j]);
+#else
+    /* fold y[] onto the 32 distinct cosines of the matrix */
+    s[t][0]  = y[16];
+    s[t][16] = y[32] + y[0];
+    for (i=1; i<16; i++)
+    {
+      s[t][i]    = y[16+i] + y[16-i];
+      s[t][i+16] = y[32+i] - y[64-i];
+    }
+
+    subband_dct(s[t], SBLIMIT, subband->dct);
+
+    /* the fractional multiply of the direct version halves the result */
+    for (i=SBLIMIT; i--; )
+      s[t][i] >>= 1;
+#endif
+  }
 }
 
+/*
+ * shine_window_filter_granule:
+ * -------------------------
+ * Overlapping window on PCM samples
+ * The 576 16-bit pcm samples of a granule are scaled to fractional 2's
+ * complement and appended to the 480 most recent ones in the window
+ * buffer #x#, then the filter kernel produces the 18x32 subband samples
+ * of #s#.
+ * Doing a whole granule per call keeps the window buffer linear (no ring
+ * offset to wrap) and the window and matrixing tables hot, with a single
+ * history copy per granule.
+ */
+void shine_window_filter_granule(int16_t **buffer, int32_t s[18][SBLIMIT], int k, shine_global_config *config)
+{
+  int32_t *x = config->subband.x[k];
+  int i;
+
+  /* append the new samples after the history */
+  for (i=0; i<samp_per_frame2; i++)
+    x[HAN_SIZE-32+i] = ((int32_t)*(*buffer)++) << 16;
+
+  config->subband.filter(x, s, &config->subband);
+
+  /* keep the most recent samples as history for the next granule */
+  memmove(x, x+samp_per_frame2, (HAN_SIZE-32)*sizeof(int32_t));
+}
@@ -16,23 +16,63 @@ void shine_set_config_mpeg_defaults(shine_mpeg_t *mpeg)
   mpeg->emph = NONE;
   mpeg->copyright = 0;
   mpeg->original  = 1;
+  mpeg->vbr       = 0;
+  mpeg->abr       = 0;
+  mpeg->speed     = 0;
+}
+
+/*
+ * frame_slots:
+ * ------------
+ * The frame size of the bitrate mpeg.bitr, in whole slots (bytes) plus
+ * the fraction the padding spreads over the frames. The reservoir limits
+ * (ABR only) follow from the frame size in shine_ResvFrameBegin.
+ */
+static void frame_slots(shine_global_config *config)
+{
+  double avg_slots_per_frame;
+
+  /* Figure average number of 'slots' per frame. */
+  avg_slots_per_frame = ((double)samp_per_frame /
+                        ((double)config->wave.samplerate/1000)) *
+                        ((double)config->mpeg.bitr /
+                         (double)config->mpeg.bits_per_slot);
+
+  config->mpeg.whole_slots_per_frame  = (int)avg_slots_per_frame;
+
+  config->mpeg.frac_slots_per_frame  = avg_slots_per_frame - (double)config->mpeg.whole_slots_per_frame;
+  config->mpeg.slot_lag              = -config->mpeg.frac_slots_per_frame;
+
+  /* VBR and ABR frames are not padded, their size is set by the rate loop */
+  if(config->mpeg.vbr || config->mpeg.abr)
+    config->mpeg.frac_slots_per_frame = 0;
+
+  if(config->mpeg.frac_slots_per_frame==0)
+    config->mpeg.padding = 0;
+
+  config->mpeg.bitrate_index = shine_find_bitrate_index(config->mpeg.bitr)+1;
+  config->abr.bitr           = config->mpeg.bitr;
 }
 
 /* Compute default encoding values. */
 shine_global_config *shine_initialise(shine_config_t *pub_config)
 {
-  double avg_slots_per_frame;
   shine_global_config *config;
+  void *alloc;
+  int side_bytes, main_min;
 
-  config = calloc(1,sizeof(shine_global_config));
-  if (config == NULL)
-    return config;
+  /* over allocate to align the buffers on a cache line */
+  alloc = calloc(1,sizeof(shine_global_config)+CACHE_LINE-1);
+  if (alloc == NULL)
+    return NULL;
+  config = (shine_global_config *)(((uintptr_t)alloc + CACHE_LINE-1) & ~(uintptr_t)(CACHE_LINE-1));
+  config->alloc = alloc;
 
   shine_subband_initialise(config);
   shine_mdct_initialise(config);
   shine_loop_initialise(config);
   shine_formatbits_initialise(config);
-  shine_bitstream_initialise(config );
+  shine_bitstream_initialise(config);
 
   /* Copy public config. */
   config->wave.channels   = pub_config->wave.channels;
@@ -42,6 +82,9 @@ shine_global_config *shine_initialise(shine_config_t *pub_config)
   config->mpeg.emph       = pub_config->mpeg.emph; 
   config->mpeg.copyright  = pub_config->mpeg.copyright;  
   config->mpeg.original   = pub_config->mpeg.original; 
+  config->mpeg.vbr        = MAX(0, MIN(pub_config->mpeg.vbr, VBR_MAX));
+  config->mpeg.abr        = config->mpeg.vbr ? 0 : MAX(0, MIN(pub_config->mpeg.abr, ABR_WINDOW));
+  config->mpeg.speed      = MAX(0, MIN(pub_config->mpeg.speed, SPEED_MAX));
 
   /* Set default values. */
   config->ResvMax        = 0;
@@ -52,30 +95,58 @@ shine_global_config *shine_initialise(shine_config_t *pub_config)
 
   config->mpeg.bits_per_slot     = 8;
 
-  /* Figure average number of 'slots' per frame. */
-  avg_slots_per_frame = ((double)samp_per_frame /
-                        ((double)config->wave.samplerate/1000)) *
-                        ((double)config->mpeg.bitr /
-                         (double)config->mpeg.bits_per_slot);
+  config->mpeg.samplerate_index = shine_find_samplerate_index(config->wave.samplerate);
+  frame_slots(config);
 
-  config->mpeg.whole_slots_per_frame  = (int)avg_slots_per_frame;
+  config->sideinfo_len = (config->wave.channels==1) ? 168 : 288;
 
-  config->mpeg.frac_slots_per_frame  = avg_slots_per_frame - (double)config->mpeg.whole_slots_per_frame;
-  config->mpeg.slot_lag              = -config->mpeg.frac_slots_per_frame;
+  /* A frame's output is at most a padded frame at the highest bitrate,
+   * plus the main data it starts up to 511 bytes back (main_data_begin is
+   * 9 bits) and the 8 bytes of the bit cache.  Those 511 bytes can span
+   * several queued frames, whose headers and side info are written on the
+   * way: one per frame at most, and at least the main data of a frame at
+   * the lowest bitrate (VBR, ABR and shine_set_bitrate can go down to it)
+   * between two of them.  Sized once, it never has to grow. */
+  side_bytes = 4 + config->sideinfo_len/8;
+  main_min   = samp_per_frame*bitrates[0]*125/config->wave.samplerate - side_bytes;
+  shine_open_bit_stream(&config->bs,
+                        samp_per_frame*bitrates[13]*125/config->wave.samplerate + 1 + 511 +
+                        (511/main_min + 1)*side_bytes + 8);
 
-  if(config->mpeg.frac_slots_per_frame==0)
-    config->mpeg.padding = 0;
+  memset((char *)&config->side_info,0,sizeof(shine_side_info_t));
 
-  config->mpeg.samplerate_index = shine_find_samplerate_index(config->wave.samplerate);
-  config->mpeg.bitrate_index    = shine_find_bitrate_index(config->mpeg.bitr)+1;
+  shine_bitstream_header(config);
 
-  shine_open_bit_stream(&config->bs, BUFFER_SIZE);
+  /* The Xing/Info frame is a CBR frame at the stream's bitrate if the tag
+   * (120 bytes after the side info) fits, or the lowest one it fits in. */
+  config->xing.seek_step = 1;
+  config->xing.vbr = config->mpeg.vbr || config->mpeg.abr;
+  config->xing.bitrate_index = (config->mpeg.vbr || config->mpeg.abr) ? 1 : config->mpeg.bitrate_index;
+  while (config->xing.bitrate_index < 14 &&
+         samp_per_frame*bitrates[config->xing.bitrate_index-1]*125/config->wave.samplerate <
+         config->sideinfo_len/8 + 120)
+    config->xing.bitrate_index++;
 
-  memset((char *)&config->side_info,0,sizeof(shine_side_info_t));
+  return config;
+}
 
-  config->sideinfo_len = (config->wave.channels==1) ? 168 : 288;
+int shine_set_bitrate(shine_global_config *config, int bitr)
+{
+  if (shine_find_bitrate_index(bitr) < 0)
+    return -1;
 
-  return config;
+  /* the stream is no longer constant bitrate, and the ABR window starts
+   * over at the new mean */
+  if (bitr != config->abr.bitr)
+  {
+    config->xing.vbr = 1;
+    config->abr.head = config->abr.n = 0;
+    config->abr.sum  = config->abr.need_sum = 0;
+  }
+
+  config->mpeg.bitr = bitr;
+  frame_slots(config);
+  return 0;
 }
 
 int shine_find_samplerate_index(long freq)
@@ -98,9 +169,9 @@ int shine_find_bitrate_index(int bitr)
   return -1; /* error - not a valid samplerate for encoder */
 }
 
-unsigned char *shine_encode_frame(shine_global_config *config, int16_t data[2][samp_per_frame], long *written)
+static void encode_frame(shine_global_config *config, int16_t data[2][samp_per_frame])
 {
-  int i, gr, channel;
+  int gr, channel;
 
   config->buffer[0] = data[0];
   if (config->wave.channels == 2)
@@ -126,8 +197,8 @@ unsigned char *shine_encode_frame(shine_global_config *config, int16_t data[2][s
   /* polyphase filtering */
   for(gr=0;gr<2;gr++)
     for(channel=config->wave.channels; channel--; )
-      for(i=0;i<18;i++)
-        shine_window_filter_subband(&config->buffer[channel], &config->l3_sb_sample[channel][gr+1][i][0] ,channel,config);
+      shine_window_filter_granule(&config->buffer[channel],
+                                  config->l3_sb_sample[channel][(config->sb_granule+gr+1)%3], channel, config);
 
   /* apply mdct to the polyphase output */
   shine_mdct_sub(config);
@@ -137,26 +208,129 @@ unsigned char *shine_encode_frame(shine_global_config *config, int16_t data[2][s
 
   /* write the frame to the bitstream */
   shine_format_bitstream(config);
+  shine_flush_bits(&config->bs);
+}
+
+/* Counts a frame of #bytes# for the Xing/Info frame */
+static void xing_count(shine_global_config *config, long bytes)
+{
+  xing_t *x = &config->xing;
+  int i;
+
+  if (x->frames % x->seek_step == 0)
+  {
+    if (x->seek_n == XING_SEEK)
+    {
+      for (i = 0; i < XING_SEEK/2; i++)
+        x->seek[i] = x->seek[2*i];
+      x->seek_n = XING_SEEK/2;
+      x->seek_step *= 2;
+    }
+    x->seek[x->seek_n++] = x->bytes;
+  }
+  x->frames++;
+  x->bytes += bytes;
+}
+
+unsigned char *shine_encode_frame(shine_global_config *config, int16_t data[2][samp_per_frame], long *written)
+{
+  encode_frame(config, data);
 
   /* Return data. */
   *written = config->bs.data_position;
   config->bs.data_position = 0;
+  xing_count(config, *written);
 
   return config->bs.data;
 }
 
+long shine_max_frame_bytes(shine_global_config *config)
+{
+  return config->bs.data_size;
+}
+
+long shine_encode_frame_into(shine_global_config *config, int16_t data[2][samp_per_frame], unsigned char *out, long size)
+{
+  unsigned char *own = config->bs.data;
+  long written;
+
+  if (size < config->bs.data_size)
+    return -1;
+
+  /* the bitstream writes forward from the start of its data */
+  config->bs.data = out;
+  encode_frame(config, data);
+  written = config->bs.data_position;
+  config->bs.data_position = 0;
+  config->bs.data = own;
+  xing_count(config, written);
+
+  return written;
+}
+
 unsigned char *shine_flush(shine_global_config *config, long *written) {
-  shine_empty_buffer(&config->bs, MINIMUM);
+  shine_BF_flush(config);
+  shine_flush_bits(&config->bs);
   *written = config->bs.data_position;
   config->bs.data_position = 0;
+  config->xing.bytes += *written;
+
+  return config->bs.data;
+}
+
+/* Stores #v# big-endian */
+static void put32(unsigned char *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+/*
+ * shine_xing_frame:
+ * -----------------
+ * An empty frame whose main data holds, after the side info, the tag
+ * "Xing" (VBR) or "Info" (CBR), the flags of the fields present, the
+ * frame and byte counts of the stream, a table of the byte positions at
+ * each percent of its duration, scaled to 0..255, and a quality 0..100.
+ * The positions are interpolated between the entries of the seek table.
+ */
+unsigned char *shine_xing_frame(shine_global_config *config, long *written)
+{
+  xing_t *x = &config->xing;
+  unsigned char *p = config->bs.data;
+  long size = samp_per_frame*bitrates[x->bitrate_index-1]*125/config->wave.samplerate;
+  double total = size + x->bytes, f, a, b, fa, fb;
+  int i, n;
+
+  memset(p, 0, size);
+  put32(p, config->mpeg.header[0] | (x->bitrate_index << 12));
+  p += config->sideinfo_len/8;
+
+  memcpy(p, x->vbr ? "Xing" : "Info", 4);
+  put32(p+4, 0xf); /* frames, bytes, toc, quality */
+  put32(p+8, x->frames);
+  put32(p+12, size + x->bytes);
+  for (i = 0; i < 100 && x->frames; i++)
+  {
+    f  = (double)i * x->frames / 100;
+    n  = (int)(f / x->seek_step);
+    a  = x->seek[n];
+    fa = (double)n * x->seek_step;
+    b  = n+1 < x->seek_n ? x->seek[n+1] : x->bytes;
+    fb = n+1 < x->seek_n ? (double)(n+1) * x->seek_step : x->frames;
+    a += (b - a) * (f - fa) / (fb - fa);
+    p[16+i] = (unsigned char)MIN(255, (size + a) * 256 / total);
+  }
+  put32(p+116, config->mpeg.vbr ? 100 - 10*config->mpeg.vbr : 100);
 
+  *written = size;
   return config->bs.data;
 }
 
 
 void shine_close(shine_global_config *config) {
-  shine_bitstream_close(config);
-  shine_formatbits_close(config);
   shine_close_bit_stream(&config->bs);
-  free(config);
+  free(config->alloc);
 }
@@ -25,7 +25,7 @@ typedef struct {
 
 enum modes {
   STEREO       = 0,
-  JOINT_STEREO = 1,
+  JOINT_STEREO = 1, /* mid/side decided per frame, intensity stereo at 64 kbps and below */
   DUAL_CHANNEL = 2,
   MONO         = 3 
 };
@@ -42,8 +42,29 @@ typedef struct {
     enum emph  emph;      /* De-emphasis */
     int        copyright;
     int        original;
+    int        vbr;       /* VBR quality, 1 (best) to 9, or 0 for CBR at `bitr` */
+    int        abr;       /* ABR window, 1 to 1024 frames over which the bitrate
+                           * averages to `bitr`, or 0 for CBR */
+    int        speed;     /* Speed level, 0 (best quality) to 3 (fastest), see below */
 } shine_mpeg_t;
 
+/* The speed levels trade quality for encoding time:
+ *   0  noise allocation over up to 4 passes of the outer loop (default)
+ *   1  noise allocation over 2 passes
+ *   2  no noise allocation, region splits searched once per granule
+ *   3  as 2 without the search and scfsi, and limited to 16kHz
+ * Encoding 44.1kHz stereo music at 128 kbps on x86-64, the time relative
+ * to level 0 with SIMD and in plain C, the bands of a granule above their
+ * masking threshold and the segmental SNR are:
+ *   0  1.00  1.00  12.67  14.1dB
+ *   1  0.68  0.72  12.76  14.4dB
+ *   2  0.40  0.60  12.86  14.5dB
+ *   3  0.39  0.53  12.20  14.4dB
+ * Level 0 is about 140 times faster than real time with SIMD. The noise
+ * allocation lowers the SNR as it moves noise to where it is masked.
+ * Level 3 has fewer bands above their threshold as the bits of the lines
+ * it drops go to the others. */
+
 typedef struct {
   shine_wave_t wave;
   shine_mpeg_t mpeg;
@@ -66,8 +87,8 @@ int shine_find_samplerate_index(long freq);
 /* Pass a pointer to a `config_t` structure and returns an initialized
  * encoder. 
  *
- * Configuration data is copied over to the encoder. It is not possible
- * to change its values after initializing the encoder at the moment.
+ * Configuration data is copied over to the encoder. Only the bitrate can
+ * be changed after initializing the encoder, see `shine_set_bitrate`.
  *
  * Checking for valid configuration values is left for the application to 
  * implement. You can use the `shine_find_bitrate_index` and 
@@ -79,6 +100,12 @@ int shine_find_samplerate_index(long freq);
  * the encoder. */
 shine_t shine_initialise(shine_config_t *config);
 
+/* Change the bitrate to `bitr` kbps (see `bitrates` above) from the next
+ * frame on, without losing the filterbank history. In ABR mode it is the
+ * new mean. Returns 0, or -1 leaving the bitrate unchanged if `bitr` is not
+ * supported. A stream whose bitrate has changed gets a Xing frame. */
+int shine_set_bitrate(shine_t s, int bitr);
+
 /* Encode audio data. Source data must have `samp_per_frames` audio samples per
  * channels. Mono encoder only expect one channel. 
  *
@@ -88,6 +115,26 @@ shine_t shine_initialise(shine_config_t *config);
  * was written. */
 unsigned char *shine_encode_frame(shine_t s, int16_t data[2][samp_per_frame], long *written);
 
+/* Maximum number of bytes a call to `shine_encode_frame` or 
+ * `shine_encode_frame_into` can produce with this encoder, at any bitrate
+ * and in VBR and ABR: a frame and the main data it starts in the frames
+ * before it, with their headers and side info. */
+long shine_max_frame_bytes(shine_t s);
+
+/* Encode audio data like `shine_encode_frame`, writing the encoded data
+ * directly into `out`, a buffer of `size` bytes provided by the caller.
+ *
+ * Returns the number of bytes written, or -1 without encoding anything if
+ * `size` is less than `shine_max_frame_bytes`. */
+long shine_encode_frame_into(shine_t s, int16_t data[2][samp_per_frame], unsigned char *out, long size);
+
+/* Returns a Xing (VBR) or Info (CBR) frame, `written` bytes long, holding the
+ * number of frames and bytes encoded so far and a seek table. Write it before
+ * the first frame, where decoders look for it, and once all data has been
+ * flushed write it again over the first one; its size does not change.
+ * The pointer is handled like the one of `shine_encode_frame`. */
+unsigned char *shine_xing_frame(shine_t s, long *written);
+
 /* Flush all data currently in the encoding buffer. Should be used before closing
  * the encoder, to make all encoded data has been written. */
 unsigned char *shine_flush(shine_t s, long *written);
@@ -10,3 +10,4 @@
 
 #define mulsr(a,b) (int32_t)  ( ( ( ((int64_t) a) * ((int64_t) b)) + 0x80000000 ) >>31 )
 
+#define mul27(a,b) (int32_t)  ( ( ((int64_t) a) * ((int64_t) b) ) >>27 )
@@ -5,6 +5,7 @@
     muls    Fractional multiply with single bit left shift.
     mulr    Fractional multiply with rounding.
     mulsr   Fractional multiply with single bit left shift and rounding.
+    mul27   Multiply by a Q27 coefficient (for factors larger than one).
 
 */
 
@@ -53,3 +54,7 @@ static inline int32_t mulsr(int32_t x, int32_t y) {
     );
     return result;
 }
+
+static inline int32_t mul27(int32_t x, int32_t y) {
+    return (int32_t) ((((int64_t) x) * ((int64_t) y)) >> 27);
+}
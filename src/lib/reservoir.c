@@ -52,15 +52,20 @@ void shine_ResvFrameBegin(int frameLength, shine_global_config *config)
  * shine_ResvMaxBits:
  * ------------
  * Called at the beginning of each granule to get the max bit
- * allowance for the current granule based on reservoir size
- * and perceptual entropy.
+ * allowance of channel #ch# based on reservoir size and perceptual
+ * entropy. The channels of the granule borrow from the reservoir as it
+ * stands before either is coded: the loan goes to them in proportion to
+ * the bits they want over the mean, and what the reservoir holds over
+ * 80% is shared evenly.
  */
-int shine_ResvMaxBits (double *pe, shine_global_config *config )
+int shine_ResvMaxBits (double pe[2], int ch, shine_global_config *config )
 {
-  int more_bits, max_bits, add_bits, over_bits;
+  int more_bits, max_bits, add_bits, over_bits, more_tot, add_tot, i;
+  int channels = config->wave.channels;
   int mean_bits = config->mean_bits;
+  int frac = (config->ResvSize * 6) / 10;
 
-  mean_bits /= config->wave.channels;
+  mean_bits /= channels;
   max_bits = mean_bits;
 
   if(max_bits>4095)
@@ -68,20 +73,22 @@ int shine_ResvMaxBits (double *pe, shine_global_config *config )
   if(!config->ResvMax)
     return max_bits;
 
-  more_bits = *pe * 3.1 - mean_bits;
-  add_bits = 0;
-  if(more_bits>100)
+  more_tot = 0;
+  for(i=0; i<channels; i++)
   {
-    int frac = (config->ResvSize * 6) / 10;
-
-    if(frac<more_bits)
-      add_bits = frac;
-    else
-      add_bits = more_bits;
+    more_bits = pe[i] * 3.1 - mean_bits;
+    if(more_bits>100)
+      more_tot += more_bits;
   }
-  over_bits = config->ResvSize - ((config->ResvMax <<3) / 10) - add_bits;
+  add_tot = frac<more_tot ? frac : more_tot;
+
+  more_bits = pe[ch] * 3.1 - mean_bits;
+  add_bits = 0;
+  if(more_bits>100)
+    add_bits = (int64_t)add_tot * more_bits / more_tot;
+  over_bits = config->ResvSize - ((config->ResvMax <<3) / 10) - add_tot;
   if (over_bits>0)
-    add_bits += over_bits;
+    add_bits += over_bits / channels;
 
   max_bits += add_bits;
   if(max_bits>4095)
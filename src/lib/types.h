@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 #include <math.h>
 
@@ -25,8 +26,24 @@
 
 /* #endif */
 
+/* saturates a 64 bit intermediate to int32_t */
+static inline int32_t sat32(int64_t x)
+{
+  return (int32_t)(x > INT32_MAX ? INT32_MAX : x < -INT32_MAX ? -INT32_MAX : x);
+}
+
 /* #define DEBUG if you want the library to dump info to stdout */
 
+/* #define DIRECT_SUBBAND if you want the polyphase filterbank to use the
+ * direct 32x64 matrixing instead of the fast DCT-32 (for comparison) */
+
+/* #define DIRECT_MDCT if you want the MDCT to be evaluated directly from the
+ * 18x36 cosine table instead of the fast DCT-IV (for comparison) */
+
+/* #define NO_SIMD if you want the plain C filterbank, MDCT and quantizer
+ * kernels even when the cpu has SSE2 or AVX2 (for comparison, the results
+ * are the same) */
+
 #define false 0
 #define true 1
 
@@ -49,6 +66,15 @@
 typedef unsigned char bool;
 #endif
 
+/* Cache line alignment of the sample buffers and tables, shine_initialise
+ * allocates the config on a 64 byte boundary */
+#define CACHE_LINE 64
+#if defined(__GNUC__)
+#define ALIGNED __attribute__((aligned(CACHE_LINE)))
+#else
+#define ALIGNED
+#endif
+
 #ifndef MAX_CHANNELS
 #define MAX_CHANNELS 2
 #endif
@@ -57,80 +83,17 @@ typedef unsigned char bool;
 #define MAX_GRANULES 2
 #endif
 
-/*
-  A BitstreamElement contains encoded data
-  to be written to the bitstream.
-  'length' bits of 'value' will be written to
-  the bitstream msb-first.
-*/
-typedef struct
-{
-    unsigned long int value;
-    unsigned int length;
-} BF_BitstreamElement;
-
-/*
-  A BitstreamPart contains a group
-  of 'nrEntries' of BitstreamElements.
-  Each BitstreamElement will be written
-  to the bitstream in the order it appears
-  in the 'element' array.
-*/
-typedef struct
-{
-    unsigned long int nrEntries;
-    BF_BitstreamElement *element;
-} BF_BitstreamPart;
-
-/*
-  This structure contains all the information needed by the
-  bitstream formatter to encode one frame of data. You must
-  fill this out and provide a pointer to it when you call
-  the formatter.
-  Maintainers: If you add or remove part of the side
-  information, you will have to update the routines that
-  make local copies of that information (in formatBitstream.c)
-*/
-
-typedef struct BF_FrameData
-{
-    int              frameLength;
-    int              nGranules;
-    int              nChannels;
-    BF_BitstreamPart *header;
-    BF_BitstreamPart *frameSI;
-    BF_BitstreamPart *channelSI[MAX_CHANNELS];
-    BF_BitstreamPart *spectrumSI[MAX_GRANULES][MAX_CHANNELS];
-    BF_BitstreamPart *scaleFactors[MAX_GRANULES][MAX_CHANNELS];
-    BF_BitstreamPart *codedData[MAX_GRANULES][MAX_CHANNELS];
-    BF_BitstreamPart *userSpectrum[MAX_GRANULES][MAX_CHANNELS];
-    BF_BitstreamPart *userFrameData;
-} BF_FrameData;
-
-/*
-  This structure contains information provided by
-  the bitstream formatter. You can use this to
-  check to see if your code agrees with the results
-  of the call to the formatter.
-*/
-typedef struct BF_FrameResults
-{
-    int SILength;
-    int mainDataLength;
-    int nextBackPtr;
-} BF_FrameResults;
-
-typedef struct BF_PartHolder
-{
-    int max_elements;
-    BF_BitstreamPart *part;
-} BF_PartHolder;
-
 typedef struct {
     int  channels;
     long samplerate;
 } priv_shine_wave_t;
 
+/* The fastest speed level, see speed_level in l3loop.c */
+#define SPEED_MAX 3
+
+/* The lowest VBR quality, see vbr_bitrate in l3loop.c */
+#define VBR_MAX 9
+
 typedef struct {
     int    mode;      /* + */ /* Stereo mode */
     int    bitr;      /* + */ /* Must conform to known bitrate - see Main.c */
@@ -148,78 +111,150 @@ typedef struct {
     int    mode_ext;
     int    copyright;  /* + */
     int    original;   /* + */
+    int    vbr;        /* + */ /* VBR quality 1 (best) to 9, 0 for CBR */
+    int    abr;        /* + */ /* ABR window in frames, 0 for CBR or VBR */
+    int    speed;      /* + */ /* speed level 0 (best) to SPEED_MAX, see l3loop.c */
+    uint32_t header[2]; /* frame header without bitrate_index and mode_ext, [padding] */
 } priv_shine_mpeg_t;
 
+/*
+  The frames and bytes encoded, for the Xing/Info frame, with the bytes
+  before every seek_step-th frame for its seek table. When the table is
+  full every other entry is dropped and the step doubled.
+*/
+#define XING_SEEK 256
+
+typedef struct {
+    long frames;
+    long bytes;
+    long seek[XING_SEEK];
+    int  seek_n;
+    int  seek_step;
+    int  bitrate_index; /* of the Xing/Info frame */
+    int  vbr;           /* the bitrate varies, Xing rather than Info */
+} xing_t;
+
+/*
+  The sizes of the last frames of the ABR window and the bits they take at
+  a fixed quality (a ring), their sums and the mean bitrate they aim at,
+  see abr_bitrate.
+*/
+#define ABR_WINDOW 1024
+
+typedef struct {
+    int     bits[ABR_WINDOW];
+    int     need[ABR_WINDOW];
+    int     head;
+    int     n;
+    int64_t sum;
+    int64_t need_sum;
+    int     bitr;
+} abr_t;
+
+/*
+  The header and side information of a frame, packed msb-first.
+  They are queued until the main data written reaches the frame's
+  position in the bitstream.
+*/
 typedef struct
 {
   int frameLength;
   int SILength;
-  int nGranules;
-  int nChannels;
-  BF_PartHolder *headerPH;
-  BF_PartHolder *frameSIPH;
-  BF_PartHolder *channelSIPH[MAX_CHANNELS];
-  BF_PartHolder *spectrumSIPH[MAX_GRANULES][MAX_CHANNELS];
+  uint64_t si[5]; /* 32 + 256 bits at most */
 } MYSideInfo;
 
-typedef struct side_info_link
-{
-    struct side_info_link *next;
-    MYSideInfo           side_info;
-} side_info_link;
+/*
+  Frames whose side info is waiting for the main data to reach them. The
+  main data can start at most 511 bytes (main_data_begin) before the
+  frame, which spans less than 10 frames of the smallest size.
+*/
+#define SIDE_QUEUE 16
 
 typedef struct {
     int BitCount;
     int ThisFrameSize;
     int BitsRemaining;
-    side_info_link *side_queue_head;
-    side_info_link *side_queue_free;
+    MYSideInfo side_queue[SIDE_QUEUE]; /* ring */
+    int side_queue_head;               /* oldest frame */
+    int side_queue_count;
 } formatbits_t;
 
+/*
+  Codewords ready to write, code << 5 | length. The tables 1..15 are
+  indexed by the signed pair and include the sign bits, the ESC tables
+  (16 and 24, whose signs follow the linbits) by the pair clamped to 15.
+  tables 1, 2-3, 5-6, 7-9, 10-12, 13 and 15 hold 3x3, 5x5, 7x7, 11x11,
+  15x15 and 31x31 pairs, plus 2 16x16 ESC tables.
+*/
+#define HUFF_PAIRS (9 + 2*25 + 2*49 + 3*121 + 3*225 + 2*961 + 2*256)
+
 typedef struct {
-  BF_FrameData    frameData;
-  BF_FrameResults frameResults;
-
-  BF_PartHolder *headerPH;
-  BF_PartHolder *frameSIPH;
-  BF_PartHolder *channelSIPH[ MAX_CHANNELS ];
-  BF_PartHolder *spectrumSIPH[ MAX_GRANULES ][ MAX_CHANNELS ];
-  BF_PartHolder *scaleFactorsPH[ MAX_GRANULES ][ MAX_CHANNELS ];
-  BF_PartHolder *codedDataPH[ MAX_GRANULES ][ MAX_CHANNELS ];
-  BF_PartHolder *userSpectrumPH[ MAX_GRANULES ][ MAX_CHANNELS ];
-  BF_PartHolder *userFrameDataPH;
-
-  side_info_link *side_queue_head;
-  side_info_link *side_queue_free;
-} l3stream_t;
+  uint32_t pair[HUFF_PAIRS];
+  uint32_t *table[32];   /* pair (0,0) of each table */
+  int stride[32];        /* and the distance between two x */
+  uint32_t quad[2][81];  /* count1 quadruples, [v+1][w+1][x+1][y+1] */
+} huffcode_t;
+
+#define QUANT_CACHE 8 /* quantizations kept per granule */
 
 typedef struct {
-  long *xr;                    /* magnitudes of the spectral values */
-  long xrsq[samp_per_frame2];  /* xr squared */
-  long xrabs[samp_per_frame2]; /* xr absolute */
-  long xrmax;                  /* maximum of xrabs array */
-  long en_tot[2]; /* gr */
-  long en[2][21];
-  long xm[2][21];
-  long xrmaxl[2];
+  int step; /* quantizer step size */
+  int max;  /* maximum of ix, above 8192 when out of the table range */
+  int bits; /* count1 and bigvalues bits with the subdv_table split, -1 until counted */
+  int end;  /* ix is zero from here on, valid once counted */
+  int ix[samp_per_frame2] ALIGNED;
+} quant_t;
+
+typedef struct l3loop_t {
+  int32_t *xr;                 /* magnitudes of the spectral values */
+  int32_t xrsq[samp_per_frame2] ALIGNED;  /* xr squared */
+  int32_t xrabs[samp_per_frame2] ALIGNED; /* xr absolute */
+  int32_t xrmax;               /* maximum of xrabs array */
+  long en_tot[2][MAX_CHANNELS]; /* gr, ch */
+  long en[2][MAX_CHANNELS][21];
+  long xm[2][MAX_CHANNELS][21];
+  int32_t xrmaxl[2][MAX_CHANNELS];
   double steptab[128]; /* 2**(-x/4)  for x = -127..0 */
-  long steptabi[128];  /* 2**(-x/4)  for x = -127..0 */
-  long int2idx[10000]; /* x**(3/4)   for x = 0..9999 */
+  uint32_t steptabi[128]; /* 2**(-x/4)  for x = -127..0 */
+  int32_t int2idx[10000] ALIGNED; /* x**(3/4)   for x = 0..9999 */
+  int32_t pow43[8193];     /* x**(4/3) for x = 0..8192, Q12, see calc_noise */
+  int32_t fourth[4];       /* 2**(x/4) for x = 0..3, Q30 */
+  int32_t ampl[16];        /* 2**(x/2) for x = 0..15, Q23, see amplify */
+  uint64_t hcost[256][4];  /* packed huffman bit costs of a pair, see subdivide */
+  quant_t quant[QUANT_CACHE]; /* quantizations of the granule, see quantize */
+  int quantnext;               /* entry to replace next */
+  int laststep[MAX_CHANNELS];  /* step size of the previous granule, see bin_search_StepSize */
+  long lasten[MAX_CHANNELS];   /* and its en_tot */
+  int is_sfb;                  /* first intensity stereo band of the frame, 21 for none */
+  int js_shift[2];             /* guard bits of the joint stereo granules, see joint_stereo */
+  /* quantizer, chosen for the cpu */
+  int (*quantize)(int ix[samp_per_frame2], int stepsize, int n, struct l3loop_t *l3loop);
 } l3loop_t;
 
-typedef struct {
-  long ca[8];
-  long cs[8];
-  long cos_l[18][36];
+typedef struct mdct_t {
+  int32_t ca[8];
+  int32_t cs[8];
+#ifdef DIRECT_MDCT
+  int32_t cos_l[2][18][36] ALIGNED; /* [band&1] */
+#endif
+  int32_t win[36][8];  /* long block window for 8 bands, [k][band&7] */
+  int32_t cos9[8][4];  /* 9 point DCT-III cosines */
+  int32_t sc9[9];      /* 18 point DCT-III odd part scaling */
+  int32_t sc18[18];    /* DCT-IV from DCT-III scaling */
+  /* granule transform (band interleaved in and out), chosen for the cpu */
+  void (*granule)(int32_t prev[18][SBLIMIT], int32_t cur[18][SBLIMIT], int32_t out[18][SBLIMIT], struct mdct_t *mdct);
 } mdct_t;
 
-typedef struct {
-  int off[2];
-  long fl[SBLIMIT][64];
-  long x[2][HAN_SIZE];
-  long z[2][HAN_SIZE];
-  long ew[HAN_SIZE];
-} subband_t; 
+typedef struct subband_t {
+#ifdef DIRECT_SUBBAND
+  int32_t fl[SBLIMIT][64] ALIGNED;
+#endif
+  int32_t dct[SBLIMIT-1];
+  int32_t x[2][HAN_SIZE-32+samp_per_frame2] ALIGNED; /* history + one granule */
+  int32_t ew[HAN_SIZE] ALIGNED;
+  /* window and matrixing of a granule, chosen for the cpu */
+  void (*filter)(int32_t *x, int32_t s[18][SBLIMIT], struct subband_t *subband);
+} subband_t;
 
 /* Side information */
 typedef struct {
@@ -281,16 +316,20 @@ typedef struct shine_global_flags {
   shine_scalefac_t  scalefactor;
   int16_t       *buffer[2];
   double         pe[2][2];
-  int            l3_enc[2][2][samp_per_frame2];
-  long           l3_sb_sample[2][3][18][SBLIMIT];
-  long           mdct_freq[2][2][samp_per_frame2];
+  int            l3_enc[2][2][samp_per_frame2] ALIGNED;
+  int32_t        l3_sb_sample[2][3][18][SBLIMIT] ALIGNED; /* ring of granules */
+  int            sb_granule; /* l3_sb_sample granule before the frame */
+  int32_t        mdct_freq[2][2][samp_per_frame2] ALIGNED;
   int            ResvSize;
   int            ResvMax;
   formatbits_t   formatbits;
-  l3stream_t     l3stream;
+  huffcode_t     huffcode;
+  xing_t         xing;
+  abr_t          abr;
   l3loop_t       l3loop;
   mdct_t         mdct;
   subband_t      subband;
+  void          *alloc; /* the block this config was aligned in */
 } shine_global_config;
 
 #endif
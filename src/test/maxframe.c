@@ -0,0 +1,106 @@
+/* maxframe.c
+ * Checks that shine_encode_frame_into never writes more than
+ * shine_max_frame_bytes. Bursts of loud noise between silences make the
+ * VBR and ABR frame sizes and the reservoir swing as far as they can, so
+ * the main data of a frame reaches back over many small frames.
+ *
+ * The buffer is allocated exactly shine_max_frame_bytes long: build with
+ * CFLAGS=-fsanitize=address to catch any write past it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "layer3.h"
+
+#define SECONDS 6
+
+static struct {
+	char *name;
+	int   channels;
+	int   mode;
+	int   bitr;
+	int   vbr;
+	int   abr;
+} tests[] = {
+	{ "stereo ABR 5",       2, STEREO,       128, 0, 5 },
+	{ "stereo VBR 1",       2, STEREO,       128, 1, 0 },
+	{ "joint stereo ABR 5", 2, JOINT_STEREO, 128, 0, 5 },
+	{ "joint stereo VBR 1", 2, JOINT_STEREO, 32,  1, 0 },
+	{ "mono ABR 1",         1, MONO,         320, 0, 1 },
+	{ "mono VBR 1",         1, MONO,         128, 1, 0 },
+};
+
+/* 46ms of full scale noise every half second, silence in between; the
+ * channels are identical in the first burst of each second */
+static void fill(int16_t buffer[2][samp_per_frame], long pos, unsigned long *seed)
+{
+	int i, ch;
+	long t;
+
+	for (i = 0; i < samp_per_frame; i++) {
+		t = (pos + i) % 22050;
+		for (ch = 0; ch < 2; ch++) {
+			*seed = *seed * 1103515245 + 12345;
+			if (t >= 2048)
+				buffer[ch][i] = 0;
+			else if (ch && (pos + i) % 44100 < 2048)
+				buffer[ch][i] = buffer[0][i];
+			else
+				buffer[ch][i] = (int16_t)(*seed >> 16);
+		}
+	}
+}
+
+static int run(int n)
+{
+	shine_config_t config;
+	shine_t s;
+	int16_t buffer[2][samp_per_frame];
+	unsigned char *out;
+	unsigned long seed = 1;
+	long pos, max, written, largest = 0;
+
+	shine_set_config_mpeg_defaults(&config.mpeg);
+	config.wave.channels   = tests[n].channels;
+	config.wave.samplerate = 44100;
+	config.mpeg.mode       = tests[n].mode;
+	config.mpeg.bitr       = tests[n].bitr;
+	config.mpeg.vbr        = tests[n].vbr;
+	config.mpeg.abr        = tests[n].abr;
+
+	s = shine_initialise(&config);
+	if (!s) {
+		printf("%s: shine_initialise failed\n", tests[n].name);
+		return 1;
+	}
+
+	max = shine_max_frame_bytes(s);
+	out = malloc(max);
+
+	for (pos = 0; pos < SECONDS * 44100; pos += samp_per_frame) {
+		fill(buffer, pos, &seed);
+		written = shine_encode_frame_into(s, buffer, out, max);
+		if (written < 0 || written > max) {
+			printf("%s: frame at %ld wrote %ld of %ld bytes\n", tests[n].name, pos, written, max);
+			return 1;
+		}
+		if (written > largest)
+			largest = written;
+	}
+
+	printf("%s: largest frame %ld of %ld bytes\n", tests[n].name, largest, max);
+	free(out);
+	shine_close(s);
+	return 0;
+}
+
+int main(void)
+{
+	int n, failed = 0;
+
+	for (n = 0; n < (int)(sizeof(tests) / sizeof(tests[0])); n++)
+		failed |= run(n);
+
+	return failed;
+}